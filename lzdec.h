@@ -0,0 +1,56 @@
+/*
+ * lzdec.h - Decoder for eeprom.lz, shared by prommer and lzpack.
+ *
+ * Copyright (C) 2011-2020 Theophilus (http://theaudiobible.org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * eeprom.lz is a sequence of big-endian 16-bit words.  Each EEPROM
+ * sector (LZ_BLOCK words) is packed on its own: one word giving the
+ * number of packed words that follow, then the tokens
+ *   0nnnnnnn nnnnnnnn   n literal words follow
+ *   1lllllll dddddddd   copy l+LZ_MIN_MATCH words from d+1 words back
+ * Matches never reach outside the sector, so the decoder needs no
+ * history beyond the output buffer.  The caller must define u_int16.
+ */
+
+#ifndef LZDEC_H
+#define LZDEC_H
+
+#define LZ_BLOCK        256
+#define LZ_MIN_MATCH    3
+#define LZ_MAX_MATCH    (0x7f + LZ_MIN_MATCH)
+#define LZ_MAX_DIST     0x100
+#define LZ_MAX_PACKED   (LZ_BLOCK + 1)  /* one literal run of the sector */
+
+/// Unpack one sector; returns the number of words, 0xffff if corrupt
+static u_int16 LzDecode(const u_int16 *in, u_int16 words, u_int16 *out) {
+    const u_int16 *end = in + words;
+    u_int16 n = 0;
+
+    while (in < end) {
+        u_int16 t = *in++;
+        if (t & 0x8000) {
+            u_int16 len = ((t >> 8) & 0x7f) + LZ_MIN_MATCH;
+            u_int16 dist = (t & 0xff) + 1;
+            if (dist > n || n + len > LZ_BLOCK) return 0xffff;
+            while (len--) {
+                out[n] = out[n - dist];
+                n++;
+            }
+        } else {
+            if (t > end - in || n + t > LZ_BLOCK) return 0xffff;
+            while (t--) out[n++] = *in++;
+        }
+    }
+    return n;
+}
+
+#endif
@@ -0,0 +1,108 @@
+/*
+ * lzpack.c - Pack eeprom.img into eeprom.lz for a faster upload.
+ *
+ * Copyright (C) 2011-2020 Theophilus (http://theaudiobible.org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * Usage: lzpack eeprom.img eeprom.lz
+ *
+ * The format is described in lzdec.h.  Every packed sector is unpacked
+ * again with the decoder prommer uses and compared with the input, so
+ * a successful run is also the round-trip check.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+typedef unsigned short u_int16;
+#include "lzdec.h"
+
+static void put16(FILE *fp, unsigned int w) {
+    putc((w >> 8) & 0xff, fp);
+    putc(w & 0xff, fp);
+}
+
+/* Greedy longest-match packing of one sector; returns packed words. */
+static unsigned int pack(const u_int16 *in, unsigned int n, u_int16 *out) {
+    unsigned int i = 0, o = 0, lit = 0;
+
+    while (i < n) {
+        unsigned int best = 0, dist = 0, j;
+        for (j = i > LZ_MAX_DIST ? i - LZ_MAX_DIST : 0; j < i; j++) {
+            unsigned int len = 0;
+            while (len < LZ_MAX_MATCH && i + len < n && in[j + len] == in[i + len]) len++;
+            if (len > best) {
+                best = len;
+                dist = i - j;
+            }
+        }
+        if (best >= LZ_MIN_MATCH) {
+            if (lit) {
+                out[o] = lit;
+                o += lit + 1;
+                lit = 0;
+            }
+            out[o++] = 0x8000 | ((best - LZ_MIN_MATCH) << 8) | (dist - 1);
+            i += best;
+        } else {
+            out[o + 1 + lit++] = in[i++];
+        }
+    }
+    if (lit) {
+        out[o] = lit;
+        o += lit + 1;
+    }
+    return o;
+}
+
+int main(int argc, char **argv) {
+    FILE *in, *out;
+    unsigned char bytes[2 * LZ_BLOCK];
+    u_int16 block[LZ_BLOCK], packed[LZ_MAX_PACKED], check[LZ_BLOCK];
+    unsigned long inWords = 0, outWords = 0;
+    size_t got;
+
+    if (argc != 3) {
+        fputs("Usage: lzpack eeprom.img eeprom.lz\n", stderr);
+        return 1;
+    }
+    if (!(in = fopen(argv[1], "rb"))) {
+        perror(argv[1]);
+        return 1;
+    }
+    if (!(out = fopen(argv[2], "wb"))) {
+        perror(argv[2]);
+        return 1;
+    }
+    while ((got = fread(bytes, 1, sizeof(bytes), in)) > 0) {
+        unsigned int n = (got + 1) / 2, p, i;
+        if (got & 1) bytes[got] = 0;
+        for (i = 0; i < n; i++) block[i] = (bytes[2 * i] << 8) | bytes[2 * i + 1];
+        p = pack(block, n, packed);
+        if (LzDecode(packed, p, check) != n || memcmp(block, check, n * sizeof(*block))) {
+            fprintf(stderr, "lzpack: round trip failed at word %lu\n", inWords);
+            fclose(out);
+            remove(argv[2]);
+            return 1;
+        }
+        put16(out, p);
+        for (i = 0; i < p; i++) put16(out, packed[i]);
+        inWords += n;
+        outWords += p + 1;
+    }
+    fclose(in);
+    if (fclose(out)) {
+        perror(argv[2]);
+        return 1;
+    }
+    printf("lzpack: %lu words in, %lu words out\n", inWords, outWords);
+    return 0;
+}
@@ -32,19 +32,61 @@
 #define SECONDS         2       /* cs.playTimeSeconds */
 #define VOLUME          4       /* Offset of volume setting */
 #define BOOKMARK        6       /* Offset of bookmark setting */
+#define SCAN_SERIAL     8       /* Offset of volume serial of the scanned card
+                                   (2 words) */
+#define SCAN_SIG        12      /* Offset of FAT signature of the scanned card */
+#define SCAN_FILES      14      /* Offset of .ogg file count of the scan */
+#define CARD_PROFILE    16      /* Offset of the profile of the last card
+                                   initialised (8 words) */
+
+/* Playback position journal (USE_JOURNAL) in the two eeprom pages
+   below the performance counters: JOURNAL_SLOTS records of 16 bytes,
+   written round robin.  It is the lowest data in the eeprom, and
+   `make' fails if the boot image does not end below it, with or
+   without USE_JOURNAL.  Autosaving after every AUTOSAVE_SECONDS of
+   playback writes 60 records per listening hour, i.e. 30 write cycles
+   per page per hour, so a 1,000,000 cycle eeprom lasts some 33,000
+   listening hours (`make wear' measures it). */
+#define JOURNAL         8000    /* 8192 - 6*32 */
+#define JOURNAL_SLOTS   4       /* 2 pages of 2 records */
+#define JOURNAL_WORDS   8       /* seq, chapter, seconds, volume, bookmark,
+                                   0, 0, crc */
+#define AUTOSAVE_SECONDS 60
+
+/* Address of the performance counters in eeprom = 8192 - 4*32 (4'th
+   last page), saved at every power off with PERF_EEPROM */
+#define PERF            8064
+
+/* Address of the boot profile in eeprom = 8192 - 3*32 (3'rd last page) */
+#define PROFILE         8096
 
 /* Address of bookmark data in eeprom = 8192 - 2*32 (i.e. 2'nd last page) */
 #define BOOKMARKS       8128
 #define BKMK_FIRST      0       /* First Bookmark (4 bytes per bookmark) */
 #define BKMK_LAST       28      /* Last Bookmark (n-1)*4 */
 
+/* minifatFragments[].start flag of a file's final fragment */
+#define FRAG_LAST       0x80000000UL
+
+#define OGG_SCAN_SECTORS 16     /* Sectors searched for the next Ogg page */
+
+#define MAX_BOOKS       96      /* Books held in the RAM book index */
+#define MAX_TESTAMENTS  4       /* Testaments held in the RAM book index */
+
 #define VOL_MIN         64      /* Minimum volume to save to eeprom - remember
                                    that the greater this number, the lower the
                                    volume */
 
-#define SYSTEMMAINFREQ      6000000
-#define BATTERYCHECKFREQ    1
+#define SYSTEMMAINFREQ      6000000 /* Timer1 clock at clockX 2 */
+#ifdef USE_TICK
+#define TICKFREQ            1000    /* Timer1 ticks per second */
+#else
+#define TICKFREQ            1       /* Timer1 only checks the battery */
+#endif
+#define BATTERYCHECK_MS     1000
 #define BATTERYLOWTIME      90
+#define BEEP_MS             200     /* beep heard before a jump mutes the amp */
+#define LED_BLINK_MS        250     /* LED half period while there is no card */
 
 /* Battery Status LED on GPIO0_13 */
 #define BAT_LED_BIT 13
@@ -66,6 +108,104 @@
 #define DEBUG_LEVEL 1
 #endif
 
+/* Time the boot phases from power-on to the first PlayCurrentFile().
+    The phase durations are printed in USE_DEBUG builds and, with
+    BOOT_PROFILE_EEPROM, also saved to the EEPROM page at PROFILE. */
+// #define USE_BOOT_PROFILE
+// #define BOOT_PROFILE_EEPROM
+
+/* Count card and EEPROM traffic, read errors, card re-inits, idle
+    calls, clock changes and the worst key-to-audio latency.  USE_DEBUG
+    builds dump the block whenever a file starts playing, and print the
+    cost of boot, each navigation key and power off, to compare with
+    the budgets in sim/bench.budget.  With PERF_EEPROM the block is kept in the eeprom
+    page at PERF across power cycles, so a returned unit carries its
+    own history.  Both cost code space in the boot image and are off by
+    default; turn them on for bench and field test builds. */
+// #define USE_PERF_COUNT
+// #define PERF_EEPROM
+
+/* Keep the OpenFile() result of the last EXTENT_FILES contiguous .ogg
+    files, so that opening one of them again reads neither the
+    directory nor the FAT.  USE_DEBUG builds print the FAT sectors read
+    for every chapter, with or without it.  Off by default: it costs
+    boot image space and EXTENT_FILES entries of RAM for a saving that
+    only shows on FAT-heavy cards. */
+// #define USE_EXTENTS
+
+/* The boot image has to end below JOURNAL, and `make' fails when it
+    does not.  The features below do not all fit, so each one is off
+    by default. */
+
+/* Save the playback position to the journal every AUTOSAVE_SECONDS
+    of playback as well as at power off, so that it survives a battery
+    pulled while playing.  Without it the position is saved at CONFIG
+    at power off only. */
+// #define USE_JOURNAL
+
+/* Keep one READ_MULTIPLE_BLOCK open while the card is read
+    sequentially. */
+// #define USE_STREAM_READ
+
+/* Read the FAT, directories and the menu through a small LRU sector
+    cache instead of the single menu sector buffer. */
+// #define USE_SECTOR_CACHE
+
+/* Build a RAM table of the book and testament boundaries at mount, so
+    that the book keys read no menu sectors. */
+// #define USE_BOOK_INDEX
+
+/* Queue eeprom page writes and program them from the idle hook, so
+    that nothing waits for the write cycle. */
+// #define USE_EEPROM_QUEUE
+
+/* Run Timer1 as a 1 kHz tick with deferred actions instead of the 1 Hz
+    battery check; USE_KEY_QUEUE also samples the keys from it.  The
+    beep before a jump does not block without it either: the idle hook
+    cancels the file when the beep has been heard. */
+// #define USE_TICK
+// #define USE_KEY_QUEUE
+
+/* Resume inside a chapter from the page SEEK.IDX lists for it, or by
+    bisecting the Ogg granule positions, instead of decoding from the
+    start of the file up to the saved second.  The splice this makes
+    in the file has only been run in the host simulation so far. */
+// #define USE_RESUME_SEEK
+
+/* Open the next chapter while the current one plays. */
+// #define USE_PREFETCH
+
+/* Keep the .ogg file count of the last card in the EEPROM, so that
+    booting with the same card does not walk the directory tree. */
+// #define USE_SCAN_CACHE
+
+/* Measure the audio buffer headroom and count underruns per file;
+    USE_DEBUG builds print them after each file. */
+// #define USE_AUDIO_METER
+
+/* Cap the clock while the measured headroom stays high (needs
+    USE_AUDIO_METER, which it turns on). */
+// #define USE_CLOCK_GOVERNOR
+
+/* After a card error, re-initialise the card and keep the mount if it
+    is the same card. */
+// #define USE_FAST_RECOVERY
+
+/* Remember the CID, capacity and ready time of the last card in the
+    EEPROM, to send fewer commands in InitializeMmc() for the same
+    card.  It does not make it faster (see struct CARDPROFILE). */
+// #define USE_CARD_PROFILE
+
+#if defined(USE_SCAN_CACHE) || defined(USE_FAST_RECOVERY) || defined(USE_EXTENTS) || defined(USE_DEBUG)
+#define USE_VOLUME_KEY
+#endif
+#if defined(USE_KEY_QUEUE) && !defined(USE_TICK)
+#define USE_TICK
+#endif
+#if defined(USE_CLOCK_GOVERNOR) && !defined(USE_AUDIO_METER)
+#define USE_AUDIO_METER
+#endif
+
 /* Removes 4G restriction from USB (SCSI).
     Also detects MMC/SD removal while attached to USB.
     (62 words) */
@@ -83,18 +223,281 @@ struct MENUENTRY {
     u_int16 subtree;        /*1 subtree index: 0 or 1..65535 */
 };
 
-struct MENU {
-    u_int32 currentSector;
-    u_int16 buffer[256];
-} menu;
+#define CACHE_SLOTS     1       /* Sectors held in the sector cache, 256 words
+                                   each.  One slot costs no more RAM than the
+                                   old menu sector buffer; a second one saved
+                                   10 of 1001 sector reads in make bench. */
+#define CACHE_EMPTY     0xffffffffUL
+
+/* LRU sector cache in front of the MMC mapper, shared by menu lookups,
+   FAT and directory reads.  Without USE_SECTOR_CACHE only CacheRead()
+   uses it, as the menu sector buffer. */
+struct SECTORCACHE {
+    u_int32 sector[CACHE_SLOTS];    /* LBA held by each slot */
+    u_int16 age[CACHE_SLOTS];       /* LRU stamp, higher is newer */
+    u_int16 clock;
+    u_int32 lastMiss;               /* to recognise sequential streaming */
+    u_int16 hits;
+    u_int16 misses;
+    u_int16 buffer[CACHE_SLOTS][256];
+} cache;
+
+u_int16 *CacheRead(u_int32 sector);
+
+#ifdef USE_RESUME_SEEK
+/* SEEK.IDX, the optional seek table written by seekidx: per file, one
+   resume page for every `interval' seconds. */
+struct SEEKINDEX {
+    u_int32 start;          /* first sector, 0 if there is no index */
+    u_int16 interval;       /* seconds between entries */
+    u_int16 files;
+    u_int16 entrySector;    /* sector of the first entry */
+} seekIndex;
+
+/* The seam of a resume splice: the bytes after the header pages in the
+   sector they end in, and the bytes before the resume page in the
+   sector it starts in, read as zeros. */
+struct SPLICE {
+    u_int32 head;           /* LBA the header pages end in, 0 for none */
+    u_int32 tail;           /* LBA the resume page starts in */
+    u_int16 headEnd;        /* first byte to blank in head */
+    u_int16 tailStart;      /* first byte not to blank in tail */
+} splice;
+#endif
+
+/* The next file, opened ahead during idle time of the current one.
+   Holds what OpenFile() left in minifatInfo and minifatFragments, so
+   that switching files is a copy.  Costs 2 * (sizeof(minifatInfo) +
+   sizeof(minifatFragments)) words of RAM, 76 in the host simulation;
+   minifatBuffer is read again rather than saved.  OpenFile() reads the
+   directory from its start, so on a card with many files opening one
+   far down takes longer than the audio buffer lasts: the reads of the
+   opening fail once the buffer is down to PREFETCH_MIN_FILL, and the
+   play loop opens the file itself when it gets there. */
+#define PREFETCH_MIN_FILL (DEFAULT_AUDIO_BUFFER_SAMPLES*3/8) /* 3/4 full */
+#ifdef USE_PREFETCH
+struct PREFETCH {
+    s_int16 tried;          /* file last opened ahead, -1 for none */
+    u_int16 valid;          /* info and fragments hold that file */
+    u_int16 inRead;         /* IdleHook() called from inside a disk read */
+    u_int16 opening;        /* PrefetchNext() is in OpenFile(), 2 when
+                               it has failed a read to give up */
+    u_int16 info[sizeof(minifatInfo)];
+    u_int16 fragments[sizeof(minifatFragments)];
+    /* minifat state of the playing file while the next one is opened */
+    u_int16 saveInfo[sizeof(minifatInfo)];
+    u_int16 saveFragments[sizeof(minifatFragments)];
+} prefetch;
+#endif
+
+/* Contiguous files opened so far, i.e. files that OpenFile() left
+   wholly in minifatFragments[0].  Their reads map the file offset
+   straight to an LBA; fragmented files are not kept and go through
+   OpenFile() every time. */
+#define EXTENT_FILES    4
+struct EXTENT {
+    u_int32 fatStart;       /* first sector of the FATs, from FatBounds() */
+    u_int32 fatSectors;     /* sectors in all FAT copies */
+    u_int16 fatReads;       /* FAT sectors read since the last report */
+    u_int16 hits;           /* opens served from the table */
+#ifdef USE_EXTENTS
+    s_int16 file[EXTENT_FILES];     /* -1 for a free slot */
+    u_int16 next;                   /* slot to replace next */
+    u_int32 start[EXTENT_FILES];    /* minifatFragments[0] */
+    u_int16 size[EXTENT_FILES];
+    u_int16 info[EXTENT_FILES][sizeof(minifatInfo)];
+#endif
+} extent;
+
+#ifdef USE_JOURNAL
+struct JOURNALSTATE {
+    u_int16 seq;            /* sequence number of the newest record */
+    u_int16 slot;           /* slot of the newest record */
+    u_int16 saved[4];       /* chapter, seconds, volume, bookmark saved */
+    u_int16 second;         /* play time seen by the idle hook */
+    u_int16 played;         /* seconds played since the last autosave */
+} journal;
+#endif
+
+#ifdef USE_TICK
+/* Work for the Timer1 tick: each action runs from the interrupt when
+   its count of ticks runs out, and is re-armed if it is periodic, so
+   nothing has to wait in a BusyWait10() loop for it. */
+enum deferredAction {
+    daBattery,      /* periodic: battery check and low battery warning */
+    daJump,         /* one-shot: amp off and cancel the file for a jump */
+    daLed,          /* periodic: blink the LED while there is no card */
+    DEFERRED_ACTIONS
+};
+struct DEFERRED {
+    u_int16 left[DEFERRED_ACTIONS];     /* ticks to go, 0 when not armed */
+    u_int16 period[DEFERRED_ACTIONS];   /* reload, 0 for one-shot */
+} deferred;
+u_int16 ticks;              /* milliseconds, counted by the tick */
+#else
+/* Without the tick the idle hook turns the amp off and cancels the
+   file for a jump once ReadTimeCount() reaches jumpAt, which is odd
+   while a jump waits for its beep and 0 otherwise. */
+u_int16 jumpAt;
+#endif
+
+#ifdef USE_FAST_RECOVERY
+/* Card errors while playing.  A sector that gets an error token is
+   first read again with a new command (MMC_READ_RETRIES times); a
+   sector that gets no token at all is not.  If that does not
+   help, the main loop re-initialises the card and, if VolumeKey() is
+   unchanged, keeps the mount (FAT, menu, book index, file count) and
+   resumes the file at the second it had reached.  Only a different
+   card goes through the full mount. */
+#define MMC_READ_RETRIES 2
+struct RECOVERY {
+    u_int16 pending;        /* card error: resume file at seconds */
+    u_int16 key[3];         /* VolumeKey() of the mounted card */
+    u_int16 file;
+    u_int16 seconds;
+    u_int16 retries;        /* sector reads retried */
+    u_int16 tier;           /* 2: mount kept, 3: full mount; for USE_DEBUG */
+    u_int32 time;           /* when the error stopped playing */
+} recovery;
+#endif
+
+#ifdef USE_KEY_QUEUE
+/* Key changes sampled by the tick, debounced and time stamped.  The
+   tick only writes head and the idle hook only writes tail.
+   KeyScan9() still does the mapping through playModeMap, and the
+   queue tells the idle hook to call it now rather than at the next
+   uiTrigger.  KeyScan9() reads the keys itself and never sees a press
+   that is released again before the idle hook runs, so KeyDrain()
+   maps such a press from the queued state instead. */
+#define KEY_QUEUE       8       /* key changes held, power of two */
+#define KEY_DEBOUNCE_MS 5
+#define KEY_GPIO_MASK   (KEY_1|KEY_2|KEY_3|KEY_4|KEY_5|KEY_6|KEY_7) /* on
+                                   GPIO0, as KEY_8 in main() */
+struct KEYQUEUE {
+    u_int16 head;           /* next entry the tick fills */
+    u_int16 tail;           /* next entry the idle hook takes */
+    u_int16 raw;            /* last sample */
+    u_int16 stable;         /* ms the sample has not changed */
+    u_int16 state;          /* last state queued */
+    u_int16 down;           /* keys taken down that KeyScan9() has not
+                               seen, until they are released */
+    struct {
+        u_int16 keys;
+        u_int16 time;       /* ticks when the change was accepted */
+    } entry[KEY_QUEUE];
+} keyQueue;
+
+#ifdef USE_PERF_COUNT
+#define USE_KEY_LATENCY
+/* Milliseconds from a queued key change to MyKeyEventHandler(), in
+   power of two buckets: 0, 1, 2-3, 4-7, ... 128 and more.  Only the
+   buckets are kept, so the percentiles printed are bucket bounds. */
+#define KEY_LATENCY_BUCKETS 9
+struct KEYLATENCY {
+    u_int16 pending;        /* a change is waiting for the handler */
+    u_int16 stamp;          /* its time */
+    u_int16 histogram[KEY_LATENCY_BUCKETS];
+} keyLatency;
+#endif
+#endif
+
+#ifdef USE_BOOK_INDEX
+/* Book and testament boundaries, built once per mount so navigation
+   keys need no menu reads while playing. */
+struct BOOKINDEX {
+    u_int16 books;
+    u_int16 first[MAX_BOOKS + 1];   /* first file of each book, then end */
+    u_int16 testaments;
+    u_int16 testamentFirst[MAX_TESTAMENTS]; /* first book of each */
+} bookIndex;
+#endif
+
+#ifdef USE_AUDIO_METER
+/* Decode headroom: how full the decoder keeps the audio buffer while a
+   file plays, sampled from the Timer1 tick or the idle hook.  An
+   underrun is the buffer running dry while the file is neither paused
+   nor cancelled. */
+#define AUDIO_FILL_MAX  (DEFAULT_AUDIO_BUFFER_SAMPLES/2) /* AudioBufFill()
+                                                    counts stereo samples */
+struct AUDIOLOAD {
+    u_int16 primed;         /* buffer has filled up since the file started */
+    u_int16 empty;          /* buffer was empty at the last sample */
+    u_int16 minFill;        /* lowest fill of the file */
+    u_int16 windowMin;      /* lowest fill since AudioWindowHeadroom() */
+    u_int16 underruns;      /* underruns of the file */
+    u_int16 totalUnderruns;
+} audioLoad;
+#endif
+
+#ifdef USE_CLOCK_GOVERNOR
+/* Clock governor on top of LoadCheck(): LoadCheck() still raises the
+   clock when the decoder falls behind, but the governor caps clockX
+   one step at a time while the measured headroom stays high, and lifts
+   the cap as soon as it drops below GOV_TARGET, and for good once the
+   file has underrun.  Low bitrate (speech) files may step down at a
+   lower headroom than music. */
+#define GOV_CLOCKX_MIN  2       /* lowest cap, 1.0x */
+#define GOV_CLOCKX_MAX  8       /* no cap, 4.0x */
+#define GOV_PERIOD      2000    /* ms between decisions */
+#define GOV_TARGET      40      /* headroom % below which the cap is lifted */
+#define GOV_HIGH_SPEECH 60      /* headroom % to step down on speech */
+#define GOV_HIGH_MUSIC  80      /* headroom % to step down on other files */
+#define GOV_HOLD        4       /* decisions to wait after lifting the cap */
+#define GOV_SPEECH_BITRATE 40000 /* nominal bits/s up to which it is speech */
+struct GOVERNOR {
+    u_int16 ceiling;        /* highest clockX allowed */
+    u_int16 high;           /* headroom % needed to step down */
+    u_int16 hold;           /* decisions left before stepping down again */
+    u_int32 decided;        /* time of the last decision */
+    u_int16 clockX;         /* clockX at the last call, capped */
+    u_int32 counted;        /* time accounted up to */
+    u_int32 msAt[GOV_CLOCKX_MAX + 1]; /* time spent at each clockX */
+} governor;
+#endif
+
+#ifdef USE_PERF_COUNT
+/* One eeprom page; the layout is what the UART dump shows. */
+struct PERFCOUNT {
+    u_int32 sectors;        /*0 sectors read from the card */
+    u_int32 tokenPolls;     /*2 bytes polled waiting for a data token */
+    u_int16 mmcCommands;    /*4 read commands and CMD12 sent */
+    u_int16 mmcInits;       /*5 InitializeMmc() attempts */
+    u_int16 eeWrites;       /*6 eeprom write cycles */
+    u_int16 eeWords;        /*7 words moved to and from the eeprom */
+    u_int16 mmcErrors;      /*8 mmc.errors raised */
+    u_int16 mmcReinits;     /*9 InitializeMmc() calls, boot included */
+    u_int32 idleCalls;      /*10 IdleHook() calls */
+    u_int16 clockChanges;   /*12 clockX changes made by LoadCheck() */
+    u_int16 keyLatency;     /*13 worst ms from a key to the new audio */
+    u_int16 boots;          /*14 power ons counted */
+    u_int16 crc;            /*15 Crc16() of words 0..14 in the eeprom */
+} perf;
+u_int16 perfClockX;         /* clockX seen by the last idle hook */
+u_int16 perfKeyPending;     /* a key changed file, audio not started */
+u_int32 perfKeyTime;        /* when it was pressed */
+#define PERF_INC(field) (perf.field++)
+#define PERF_ADD(field, n) (perf.field += (n))
+#else
+#define PERF_INC(field)
+#define PERF_ADD(field, n)
+#endif
 
 
 /* Global variables */
-struct MENUENTRY playingEntry;
+#ifdef USE_BOOK_INDEX
+u_int16 playingBook;        /* book index of the current file */
+#else
+struct MENUENTRY playingEntry;  /* menu entry of the current file */
+#endif
 u_int32 menuStart;          /* menu file must be unfragmented! */
 u_int16 offset;             /* menu index offset of first file */
 u_int16 book1;              /* parent index of first book */
-u_int16 battery_low = BATTERYLOWTIME; /* Seconds to warn of battery low */
+u_int16 battery_low = BATTERYLOWTIME; /* Seconds to warn of battery low,
+                                         0 to power off */
+#ifdef USE_TICK
+u_int16 timerClockX;        /* clockX the Timer1 reload is set for */
+#endif
+u_int16 playing;            /* PlayCurrentFile() running */
 s_int16 bookmark;           /* pointer to current bookmark */
 u_int16 bkmk_pressed = 0;   /* set if bookmark was pressed */
 u_int16 goTo;               /* offset of seconds to start within file */
@@ -184,7 +587,30 @@ void SpiWaitStatus(void) {
     SPI_MASTER_8BIT_CSHI; 
 }
 
-void SpiWrite(u_int16 addr, u_int16 data) {
+#define PAGESIZE        32      /* eeprom page size in bytes */
+
+#ifdef USE_EEPROM_QUEUE
+#define EEQ_ENTRIES     4       /* pending page writes, power of two */
+
+/* Page writes queued by the key handlers and the autosave.  The idle
+   hook moves the queue on by one state per call, so nobody waits for
+   the multi-millisecond write cycle while the decoder needs the CPU. */
+struct EEQUEUE {
+    u_int16 head;           /* entry being (or next to be) programmed */
+    u_int16 tail;           /* next free entry */
+    u_int16 busy;           /* write cycle of entry head running */
+    struct {
+        u_int16 addr;
+        u_int16 words;
+        u_int16 data[PAGESIZE/2];
+    } entry[EEQ_ENTRIES];
+} eeQueue;
+#endif
+
+/* Send WRITE_ENABLE and WRITE for words 16-bit words from data at addr
+   and return while the eeprom runs its write cycle.  The range must
+   not cross a PAGESIZE boundary. */
+void SpiWriteStart(u_int16 addr, register const u_int16 *data, register u_int16 words) {
     SPI_MASTER_8BIT_CSHI; 
     SpiDelay(0);
     SPI_MASTER_8BIT_CSLO;
@@ -195,9 +621,13 @@ void SpiWrite(u_int16 addr, u_int16 data) {
     SpiSendReceive(SPI_EEPROM_COMMAND_WRITE);
     SPI_MASTER_16BIT_CSLO;
     SpiSendReceive(addr);
-    SpiSendReceive(data); 
+    PERF_INC(eeWrites);
+    PERF_ADD(eeWords, words);
+    for (; words > 0; words--) SpiSendReceive(*data++);
     SPI_MASTER_8BIT_CSHI;
-    SpiWaitStatus();
+}
+
+void SpiWriteEnd(void) {
     SPI_MASTER_8BIT_CSHI; 
     SpiDelay(0);
     SPI_MASTER_8BIT_CSLO;
@@ -205,21 +635,199 @@ void SpiWrite(u_int16 addr, u_int16 data) {
     SPI_MASTER_8BIT_CSHI;
 }
 
-u_int16 SpiRead(u_int16 addr) {
-    register u_int16 data;
+#ifdef USE_EEPROM_QUEUE
+/// Read the status register once and return the write-in-progress bit
+u_int16 SpiBusy(void) {
+    register u_int16 status;
+
+    SPI_MASTER_8BIT_CSHI;
+    SpiDelay(0);
+    SPI_MASTER_8BIT_CSLO;
+    SpiSendReceive(SPI_EEPROM_COMMAND_READ_STATUS_REGISTER); 
+    status = SpiSendReceive(0xff);
+    SPI_MASTER_8BIT_CSHI; 
+    return status & 0x01;
+}
+
+/* Move the write queue on by one state without waiting. */
+void EepromStep(void) {
+    if (eeQueue.busy) {
+        if (SpiBusy()) return;
+        SpiWriteEnd();
+        eeQueue.busy = 0;
+        eeQueue.head = (eeQueue.head + 1) & (EEQ_ENTRIES - 1);
+    } else if (eeQueue.head != eeQueue.tail) {
+        SpiWriteStart(eeQueue.entry[eeQueue.head].addr,
+                      eeQueue.entry[eeQueue.head].data,
+                      eeQueue.entry[eeQueue.head].words);
+        eeQueue.busy = 1;
+    }
+}
+
+/* Program everything queued before returning. */
+void EepromFlush(void) {
+    while (eeQueue.busy || eeQueue.head != eeQueue.tail) {
+        EepromStep();
+    }
+}
+
+/* Queue a page write of words 16-bit words (at most PAGESIZE/2, not
+   crossing a page).  Waits only if the queue is full. */
+void EepromQueue(u_int16 addr, const u_int16 *data, u_int16 words) {
+    register u_int16 t = eeQueue.tail;
+
+    while (((t + 1) & (EEQ_ENTRIES - 1)) == eeQueue.head) {
+        EepromStep();
+    }
+    eeQueue.entry[t].addr = addr;
+    eeQueue.entry[t].words = words;
+    memcpy(eeQueue.entry[t].data, data, words);
+    eeQueue.tail = (t + 1) & (EEQ_ENTRIES - 1);
+}
+
+#else
+#define EepromQueue(addr, data, words) SpiWritePage(addr, data, words)
+#define EepromFlush()
+#endif
 
+/* Program a page now, after anything already queued. */
+void SpiWritePage(u_int16 addr, const u_int16 *data, u_int16 words) {
+    EepromFlush();
+    SpiWriteStart(addr, data, words);
+    SpiWaitStatus();
+    SpiWriteEnd();
+}
+
+/* Read words 16-bit words from addr in one burst.  Queued writes are
+   programmed first so that they are read back. */
+void SpiReadWords(u_int16 addr, register u_int16 *data, register u_int16 words) {
+    EepromFlush();
     SpiWaitStatus();    
     SPI_MASTER_8BIT_CSLO;
     SpiSendReceive(SPI_EEPROM_COMMAND_READ);
     SPI_MASTER_16BIT_CSLO;
     SpiSendReceive(addr);
-    data = SpiSendReceive(0);
+    PERF_ADD(eeWords, words);
+    for (; words > 0; words--) *data++ = SpiSendReceive(0);
     SPI_MASTER_8BIT_CSHI;
-    return data;
 }
 
+#if defined(USE_JOURNAL) || defined(PERF_EEPROM) || defined(USE_CARD_PROFILE) || defined(USE_VOLUME_KEY)
+/* CRC-16-CCITT of n words. */
+u_int16 Crc16(register const u_int16 *p, register u_int16 n) {
+    register u_int16 crc = 0xffff;
+
+    for (; n > 0; n--) {
+        register u_int16 i;
+        crc ^= *p++;
+        for (i = 16; i > 0; i--) {
+            crc = (crc & 0x8000) ? (crc << 1) ^ 0x1021 : crc << 1;
+        }
+    }
+    return crc;
+}
+#endif
+
+#ifdef USE_JOURNAL
+/* Find the newest valid journal record and copy its chapter, seconds,
+   volume and bookmark to config.  Returns 0 if there is none. */
+u_int16 JournalLoad(u_int16 *config) {
+    u_int16 rec[JOURNAL_WORDS];
+    register u_int16 i, found = 0;
+
+    for (i = 0; i < JOURNAL_SLOTS; i++) {
+        SpiReadWords(JOURNAL + i * 2*JOURNAL_WORDS, rec, JOURNAL_WORDS);
+        if (Crc16(rec, JOURNAL_WORDS - 1) == rec[JOURNAL_WORDS - 1] &&
+            (!found || (s_int16)(rec[0] - journal.seq) > 0)) {
+            found = 1;
+            journal.seq = rec[0];
+            journal.slot = i;
+            memcpy(journal.saved, rec + 1, 4);
+        }
+    }
+    if (found) memcpy(config, journal.saved, 4);
+    return found;
+}
+
+/* Append the chapter, seconds, volume and bookmark to the journal,
+   unless they are what the newest record already holds. */
+void JournalSave(void) {
+    u_int16 rec[JOURNAL_WORDS];
+
+    rec[1] = player.currentFile;
+    rec[2] = (u_int16)cs.playTimeSeconds;
+    rec[3] = player.volume > VOL_MIN ? VOL_MIN : player.volume;
+    rec[4] = bookmark;
+    if (!memcmp(rec + 1, journal.saved, 4)) return;
+    memcpy(journal.saved, rec + 1, 4);
+    if (++journal.slot >= JOURNAL_SLOTS) journal.slot = 0;
+    rec[0] = ++journal.seq;
+    rec[5] = rec[6] = 0;
+    rec[JOURNAL_WORDS - 1] = Crc16(rec, JOURNAL_WORDS - 1);
+    EepromQueue(JOURNAL + journal.slot * 2*JOURNAL_WORDS, rec, JOURNAL_WORDS);
+}
+#else
+#define JournalLoad(config) 0
+
+/* Save the chapter, seconds, volume and bookmark at CONFIG. */
+void JournalSave(void) {
+    u_int16 config[4];
+
+    config[0] = player.currentFile;
+    config[1] = (u_int16)cs.playTimeSeconds;
+    config[2] = player.volume > VOL_MIN ? VOL_MIN : player.volume;
+    config[3] = bookmark;
+    SpiWritePage(CONFIG + CHAPTER, config, 4);
+}
+#endif
+
+#ifdef USE_PERF_COUNT
+/* Pick up the counters saved at the last power off, if any. */
+void PerfLoad(void) {
+#ifdef PERF_EEPROM
+    struct PERFCOUNT saved;
+
+    SpiReadWords(PERF, (u_int16 *)&saved, sizeof(saved));
+    if (Crc16((u_int16 *)&saved, sizeof(saved) - 1) == saved.crc) {
+        memcpy(&perf, &saved, sizeof(perf));
+    }
+#endif
+    perf.boots++;
+}
+
+/* Key to audio: started by a key that changes the file, ended when
+   the new file starts playing. */
+void PerfKeyStart(void) {
+    if (!perfKeyPending) {
+        perfKeyPending = 1;
+        perfKeyTime = ReadTimeCount();
+    }
+}
+
+void PerfKeyEnd(void) {
+    if (perfKeyPending) {
+        register u_int16 ms = (u_int16)(ReadTimeCount() - perfKeyTime);
+        perfKeyPending = 0;
+        if (ms > perf.keyLatency) perf.keyLatency = ms;
+    }
+}
+
+void PerfSave(void) {
+#ifdef PERF_EEPROM
+    u_int16 page[sizeof(perf)];
+
+    memcpy(page, &perf, sizeof(perf));
+    page[sizeof(perf) - 1] = Crc16(page, sizeof(perf) - 1);
+    SpiWritePage(PERF, page, sizeof(perf));
+#endif
+}
+#endif
+
 int MenuInit(void) {
     static const u_int32 mnuFiles[] = {FAT_MKID('M', 'N', 'U'), 0 };
+#ifdef USE_RESUME_SEEK
+    static const u_int32 idxFiles[] = {FAT_MKID('I', 'D', 'X'), 0 };
+#endif
 
     minifatInfo.supportedSuffixes = &mnuFiles[0];
     /* MENU.MNU */
@@ -233,6 +841,25 @@ int MenuInit(void) {
         menuStart = minifatFragments[0].start & 0x7fffffffUL;
 #ifdef USE_DEBUG
         puthex(menuStart); puts("=menuStart");
+#endif
+#ifdef USE_RESUME_SEEK
+        /* SEEK.IDX is optional and must be unfragmented as well */
+        seekIndex.start = 0;
+        minifatInfo.supportedSuffixes = &idxFiles[0];
+        if (OpenFileBaseName("\pSEEK    ") != 0xffffU) {
+            register u_int32 start = minifatFragments[0].start & 0x7fffffffUL;
+            register const u_int16 *p = CacheRead(start);
+            if (p[0] == 0x534b && p[1] == 0x4958 && p[2] == 1 && p[3]) {
+                /* "SKIX", version 1 */
+                seekIndex.start = start;
+                seekIndex.interval = p[3];
+                seekIndex.files = p[4];
+                seekIndex.entrySector = p[5];
+            }
+        }
+#ifdef USE_DEBUG
+        puthex(seekIndex.start); puts("=seekIndex.start");
+#endif
 #endif
         return 0;
     }
@@ -253,13 +880,370 @@ const void *MenuGetEntry(register __c0 u_int16 entry) {
     puthex(sector);
     puts("=sector");
 #endif
-    if (sector != menu.currentSector) {
-        menu.currentSector = sector;
-        MapperReadDiskSector(menu.buffer, sector);
+    return (void *)(CacheRead(sector) + (wordPos & 255));
+}
+
+#ifdef USE_RESUME_SEEK
+/* Word pair at word w of SEEK.IDX.  Pairs never straddle a sector. */
+u_int32 SeekIndexLong(u_int32 w) {
+    register const u_int16 *p = CacheRead(seekIndex.start + (w >> 8)) + ((u_int16)w & 255);
+    return ((u_int32)p[0] << 16) | p[1];
+}
+
+/* Byte offset of the page to resume file at seconds from, or 0 if the
+   index has nothing for it.  *audioStart gets the offset of the
+   file's first audio page, which ends the Vorbis headers. */
+u_int32 SeekIndexLookup(u_int16 file, u_int16 seconds, u_int32 *audioStart) {
+    register u_int32 first, entries, e;
+
+    if (!seekIndex.start || file >= seekIndex.files) return 0;
+    first = SeekIndexLong(8 + 2 * (u_int32)file);
+    entries = SeekIndexLong(8 + 2 * (u_int32)file + 2) - first;
+    if (entries == 0) return 0;
+    e = seconds / seekIndex.interval;
+    if (e >= entries) e = entries - 1;
+    first += (u_int32)seekIndex.entrySector << 6; /* 64 entries per sector */
+    *audioStart = SeekIndexLong(first << 2);
+    return SeekIndexLong((first + e) << 2);
+}
+
+#endif
+
+#if defined(USE_VOLUME_KEY) || defined(USE_RESUME_SEEK) || defined(USE_CLOCK_GOVERNOR)
+/* Byte i of a sector buffer; the VS1000 packs bytes big-endian. */
+u_int16 SectorByte(register const u_int16 *p, register u_int16 i) {
+    return (i & 1) ? p[i >> 1] & 0xff : p[i >> 1] >> 8;
+}
+
+/* Little-endian 32-bit value at byte i of a sector buffer. */
+u_int32 SectorLong(register const u_int16 *p, register u_int16 i) {
+    return SectorByte(p, i) | (SectorByte(p, i + 1) << 8) |
+        ((u_int32)(SectorByte(p, i + 2) | (SectorByte(p, i + 3) << 8)) << 16);
+}
+#endif
+
+#ifdef USE_RESUME_SEEK
+/* Nonzero if an Ogg page starts at byte off of the open, unfragmented
+   file: SEEK.IDX may be stale, or written for other files. */
+u_int16 OggPageAt(u_int32 off) {
+    static const u_int16 capture[] = {'O', 'g', 'g', 'S'};
+    register u_int32 lba = minifatFragments[0].start & 0x7fffffffUL;
+    register u_int16 n;
+
+    if (!(minifatFragments[0].start & FRAG_LAST) ||
+        off + 27 > minifatInfo.fileSize) {
+        return 0;
+    }
+    for (n = 0; n < 4; n++, off++) {
+        if (SectorByte(CacheRead(lba + (off >> 9)), (u_int16)off & 511) != capture[n]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Find the first audio page (granule position neither 0 nor -1) that
+   starts in file sectors at..at+OGG_SCAN_SECTORS-1 of the open,
+   unfragmented file.  A capture pattern only counts if the version is
+   0, the header type is valid and another page (or the end of the
+   file) follows where the segment table says the page ends, so "OggS"
+   inside audio data is passed over.  Returns the byte offset of the
+   capture pattern and the low 32 bits of the granule position, or
+   0xffffffff. */
+u_int32 OggNextPage(u_int32 at, u_int32 *granule) {
+    static const u_int16 capture[] = {'O', 'g', 'g', 'S'};
+    register u_int32 lba = (minifatFragments[0].start & 0x7fffffffUL) + at;
+    register u_int32 end = at + OGG_SCAN_SECTORS;
+    register u_int32 last = minifatInfo.fileSize >> 9;
+    register u_int16 n = 0;
+    u_int32 start = 0, len = 0;
+    u_int16 segments = 0;
+
+    if (end > last) end = last;
+    /* a page that starts before end is read to its end */
+    for (; at < end || (n && at < last); at++, lba++) {
+        register const u_int16 *p = CacheRead(lba);
+        register u_int16 i;
+        for (i = 0; i < 512; i++) {
+            register u_int16 b = SectorByte(p, i);
+            if (n < 4) {
+                if (n == 0 && at >= end) return 0xffffffffUL;
+                if (b == capture[n]) {
+                    if (n++ == 0) start = (at << 9) + i;
+                } else {
+                    n = 0;
+                    if (b == 'O') {
+                        n = 1;
+                        start = (at << 9) + i;
+                    }
+                }
+            } else if (n == 4) {
+                n = b ? 0 : 5;                  /* version */
+            } else if (n == 5) {
+                n = (b & 0xf8) ? 0 : 6;         /* header type */
+            } else if (n < 10) {
+                /* granule position, little-endian */
+                *granule = (*granule >> 8) | ((u_int32)b << 24);
+                if (++n == 10 && (*granule == 0 || *granule == 0xffffffffUL)) {
+                    n = 0;
+                }
+            } else if (n < 26) {
+                n++;            /* granule high word, serial, sequence, CRC */
+            } else if (n == 26) {
+                segments = b;
+                len = 27 + b;
+                n++;
+            } else {
+                len += b;       /* segment table */
+                n++;
+            }
+            if (n == 27 + segments) {
+                if (start + len == minifatInfo.fileSize || OggPageAt(start + len)) {
+                    return start;
+                }
+                p = CacheRead(lba);
+                n = 0;
+            }
+        }
+    }
+    return 0xffffffffUL;
+}
+
+/* Resume position without an index: bisect the sector range of the
+   open, unfragmented file on the granule positions of the pages found
+   there.  Each probe reads at most OGG_SCAN_SECTORS sectors and there
+   are log2(file sectors) probes, so the file is never read through.
+   Returns the byte offset of a page that starts at or before seconds,
+   or 0, and the offset of the first audio page in *audioStart. */
+u_int32 OggBisect(u_int16 seconds, u_int32 *audioStart) {
+    register const u_int16 *p;
+    register u_int32 lo, hi, target, page;
+    u_int32 granule;
+
+    if (!(minifatFragments[0].start & FRAG_LAST)) return 0;
+    /* sample rate from the identification header on the first page */
+    p = CacheRead(minifatFragments[0].start & 0x7fffffffUL);
+    lo = 27 + SectorByte(p, 26) + 12;
+    target = (u_int32)seconds * (SectorByte(p, (u_int16)lo) |
+                                 (SectorByte(p, (u_int16)lo + 1) << 8) |
+                                 ((u_int32)SectorByte(p, (u_int16)lo + 2) << 16));
+    page = OggNextPage(0, &granule);
+    if (page == 0xffffffffUL || granule > target) return 0;
+    *audioStart = page;
+    lo = page >> 9;
+    hi = minifatInfo.fileSize >> 9;
+    while (hi - lo > OGG_SCAN_SECTORS) {
+        register u_int32 mid = (lo + hi) >> 1;
+        register u_int32 at = OggNextPage(mid, &granule);
+        /* the page at `at' ends at granule, so the next one starts
+           there: resuming at `at' still begins before the target */
+        if (at == 0xffffffffUL || granule > target) {
+            hi = mid;
+        } else {
+            page = at;
+            /* the probe may have found its page at or past hi */
+            lo = at >> 9;
+            if (lo > hi) lo = hi;
+        }
+    }
+#ifdef USE_DEBUG
+    puthex(lo>>16); puthex(lo); puts("=bisect sector");
+#endif
+    return page;
+}
+
+/* Zero bytes from..to-1 of a sector buffer. */
+void SectorBlank(register u_int16 *p, register u_int16 from, register u_int16 to) {
+    if (from & 1) p[from++ >> 1] &= 0xff00;
+    if (to & 1) p[to-- >> 1] &= 0x00ff;
+    if (to > from) memset(p + (from >> 1), 0, (to - from) >> 1);
+}
+
+/* Cut the open file so that it reads its header pages and then goes on
+   at the sector holding the page at pageOffset.  Both sectors at the
+   cut are blanked around it (see struct SPLICE), so the Ogg layer
+   reads whole pages on either side and finds the resume page on its
+   capture pattern, and the decoder takes the play time from the page's
+   granule position, so cs.goTo only has the rest of one page to cover.
+   Only done for files in a single fragment. */
+void ResumeSplice(u_int32 audioStart, u_int32 pageOffset) {
+    register u_int32 keep = (audioStart >> 9) + 1;
+    register u_int32 at = pageOffset >> 9;
+    register u_int32 lba = minifatFragments[0].start & 0x7fffffffUL;
+
+    if (!(minifatFragments[0].start & FRAG_LAST) || at <= keep ||
+        pageOffset >= minifatInfo.fileSize) {
+        return;
+    }
+    splice.head = lba + keep - 1;
+    splice.headEnd = (u_int16)audioStart & 511;
+    splice.tail = lba + at;
+    splice.tailStart = (u_int16)pageOffset & 511;
+    minifatFragments[1].start = minifatFragments[0].start + at;
+    minifatFragments[1].size = minifatFragments[0].size - (u_int16)at;
+    minifatFragments[0].start &= ~FRAG_LAST;
+    minifatFragments[0].size = (u_int16)keep;
+    minifatInfo.fileSize -= (at - keep) << 9;
+#ifdef USE_DEBUG
+    puthex(at>>16); puthex(at); puts("=resume sector");
+#endif
+}
+#endif
+
+#ifdef USE_VOLUME_KEY
+/* Note where the FATs of the mounted volume lie, for counting FAT
+   reads, and return its boot sector.  Called at every mount. */
+const u_int16 *FatBounds(void) {
+    register const u_int16 *p = CacheRead(0);
+    register u_int32 boot = 0;
+
+    if (SectorByte(p, 11) != 0x00 || SectorByte(p, 12) != 0x02 ||
+        (SectorByte(p, 0) != 0xeb && SectorByte(p, 0) != 0xe9)) {
+        /* MBR: first partition */
+        boot = SectorLong(p, 0x1c6);
+        p = CacheRead(boot);
     }
-    return (void *)(menu.buffer + (wordPos & 255));
+    extent.fatStart = boot + (SectorByte(p, 0x0e) | (SectorByte(p, 0x0f) << 8));
+    extent.fatSectors = SectorByte(p, 0x10) *
+        ((SectorByte(p, 0x16) | SectorByte(p, 0x17)) ?
+         (u_int32)(SectorByte(p, 0x16) | (SectorByte(p, 0x17) << 8)) :
+         SectorLong(p, 0x24));
+    return p;
 }
 
+/* Identify the mounted volume: key[0..1] = volume serial number,
+   key[2] = signature of the content, folded from the position of
+   MENU.MNU, a Crc16() of the first root directory sector (which
+   changes when files are added, removed or renamed there, on any FAT)
+   and on FAT32 the FSInfo free cluster count and next free cluster
+   (both change whenever files are added, removed or resized anywhere
+   on the volume).  Returns 1 on FAT32, 0 on FAT12/16, where files
+   written in a subdirectory or past the first root sector leave the
+   key as it was. */
+u_int16 VolumeKey(u_int16 *key) {
+    register const u_int16 *p = FatBounds();
+    register u_int32 boot, sig = menuStart;
+    register u_int32 root = extent.fatStart + extent.fatSectors;
+    register u_int16 fat32 = 1;
+
+    if (SectorByte(p, 0x16) | SectorByte(p, 0x17)) {
+        /* FAT12/16: the root directory follows the FATs */
+        boot = SectorLong(p, 0x27);
+        fat32 = 0;
+    } else {
+        /* FAT32 */
+        register u_int16 fsInfo = SectorByte(p, 0x30) | (SectorByte(p, 0x31) << 8);
+        register u_int32 serial = SectorLong(p, 0x43);
+        root += (SectorLong(p, 0x2c) - 2) * SectorByte(p, 0x0d);
+        p = CacheRead(extent.fatStart + fsInfo -
+                      (SectorByte(p, 0x0e) | (SectorByte(p, 0x0f) << 8)));
+        sig ^= SectorLong(p, 0x1e8) ^ SectorLong(p, 0x1ec);
+        boot = serial;
+    }
+    sig ^= Crc16(CacheRead(root), 256);
+    key[0] = (u_int16)(boot >> 16);
+    key[1] = (u_int16)boot;
+    key[2] = (u_int16)(sig >> 16) ^ (u_int16)sig;
+    return fat32;
+}
+#endif
+
+/* Number of .ogg files on the volume.  OpenFile(0xffffU) walks the
+   whole directory tree, so with USE_SCAN_CACHE the result is kept in
+   the EEPROM together with the volume key and reused while the key
+   matches.  Only on FAT32: the FAT12/16 key does not see files added
+   or removed in subdirectories (see VolumeKey()). */
+u_int16 CountFiles(void) {
+#ifdef USE_SCAN_CACHE
+    u_int16 key[4], saved[4];
+    register u_int16 n;
+
+    if (!VolumeKey(key)) {
+        return OpenFile(0xffffU);
+    }
+    SpiReadWords(CONFIG + SCAN_SERIAL, saved, 4);
+    if (saved[0] == key[0] && saved[1] == key[1] && saved[2] == key[2]) {
+        n = saved[3];
+        if (n != 0 && n != 0xffffU) {
+#ifdef USE_DEBUG
+            puthex(n); puts("=cached file count");
+#endif
+            return n;
+        }
+    }
+    n = OpenFile(0xffffU);
+    if (n) {
+        key[3] = n;
+        SpiWritePage(CONFIG + SCAN_SERIAL, key, 4);
+    }
+    return n;
+#else
+    return OpenFile(0xffffU);
+#endif
+}
+
+/* One past the last file of the last book, which limits
+   player.totalFiles.  Menu layout: entry 0 is the root, 1..book1-1 the
+   testaments, book1..offset-1 the books and the files follow from
+   offset. */
+u_int16 MenuFilesEnd(void) {
+    register const struct MENUENTRY *m;
+    register u_int16 subtree, offsetlastbook = offset - 1;
+
+    m = (struct MENUENTRY *)MenuGetEntry(offsetlastbook);
+    subtree = m->subtree;
+    do {
+        m = (struct MENUENTRY *)MenuGetEntry(subtree);
+        subtree++;
+    } while (m->parent == offsetlastbook);
+    return subtree - offset;
+}
+
+#ifdef USE_BOOK_INDEX
+/* Fill bookIndex from the menu; end is MenuFilesEnd(). */
+void BookIndexInit(u_int16 end) {
+    register const struct MENUENTRY *m;
+    register u_int16 b, t;
+
+    bookIndex.books = offset - book1;
+    if (bookIndex.books > MAX_BOOKS) bookIndex.books = MAX_BOOKS;
+    bookIndex.testaments = book1 - 1;
+    if (bookIndex.testaments > MAX_TESTAMENTS) bookIndex.testaments = MAX_TESTAMENTS;
+    for (t = 0; t < MAX_TESTAMENTS; t++) {
+        bookIndex.testamentFirst[t] = bookIndex.books;
+    }
+    for (b = 0; b < bookIndex.books; b++) {
+        m = (struct MENUENTRY *)MenuGetEntry(book1 + b);
+        bookIndex.first[b] = m->subtree - offset;
+        t = m->parent - 1;
+        if (t < bookIndex.testaments && bookIndex.testamentFirst[t] > b) {
+            bookIndex.testamentFirst[t] = b;
+        }
+    }
+    bookIndex.first[bookIndex.books] = end;
+}
+
+/* Book holding file, by bisection of bookIndex.first[]. */
+u_int16 BookOf(u_int16 file) {
+    register u_int16 lo = 0, hi = bookIndex.books;
+
+    while (hi - lo > 1) {
+        register u_int16 mid = (lo + hi) >> 1;
+        if (bookIndex.first[mid] <= file) lo = mid;
+        else hi = mid;
+    }
+    return lo;
+}
+
+/* Testament holding book. */
+u_int16 TestamentOf(u_int16 book) {
+    register u_int16 t = bookIndex.testaments;
+
+    while (t > 1 && book < bookIndex.testamentFirst[t-1]) t--;
+    return t - 1;
+}
+#endif
+
 #ifdef PATCH_LBAB
 #include <scsi.h>
 extern struct SCSIVARS {
@@ -281,6 +1265,27 @@ extern struct SCSIVARS {
 } SCSI;
 #endif/*PATCH_LBAB*/
 
+#ifdef USE_CARD_PROFILE
+/* What InitializeMmc() learnt about the last card.  When the CID
+   manufacturer ID and serial number match, READ_OCR and the CSD are
+   skipped.  The first ACMD41 wait is 3/4 of the time the card needed
+   last time.  Reading the CID (SEND_CID) costs a command and 18 bytes
+   of its own, and timing the ACMD41 waits with ReadTimeCount() costs
+   more than BusyWait10() does: in the host simulation the init takes
+   some ms longer than without the profile, with 17 commands fewer. */
+#define ACMD41_POLL_MS  10      /* longest wait between ACMD41 polls */
+struct CARDPROFILE {
+    u_int16 mid;            /* CID manufacturer ID */
+    u_int32 serial;         /* CID product serial number */
+    u_int16 hcShift;
+    u_int32 blocks;
+    u_int16 readyMs;        /* ms from the first ACMD41 to ready */
+    u_int16 crc;            /* Crc16() of the words above */
+} cardProfile;
+/* CARD_PROFILE has room for 8 words */
+typedef char cardProfileFits[sizeof(cardProfile) == 8 ? 1 : -1];
+#endif
+
 enum mmcState {
     mmcNA = 0, 
     mmcOk = 1, 
@@ -290,6 +1295,10 @@ struct {
     s_int16 errors;
     s_int16 hcShift;
     u_int32 blocks;
+#ifdef USE_STREAM_READ
+    u_int16 streaming;  /* READ_MULTIPLE_BLOCK transfer open */
+    u_int32 next;       /* block after the last one read */
+#endif
 } mmc;
 
 #ifdef USE_DEBUG
@@ -305,11 +1314,180 @@ void puthex(u_int16 d) {
 }
 #endif
 
+#if defined(USE_PERF_COUNT) && defined(USE_DEBUG)
+void PerfPrint(void) {
+    register const u_int16 *p = (const u_int16 *)&perf;
+    register u_int16 i;
+
+    for (i = sizeof(perf); i > 0; i--) puthex(*p++);
+    puts("=perf");
+}
+
+#define PERF_BOOT       0xffffU /* perfActions[] event of power on to audio */
+#define PERF_POWEROFF   0xfffeU /* perfActions[] event of MyPowerOff() */
+
+/* The user actions whose cost is printed.  Their budgets are kept only
+   in sim/bench.budget, which make bench checks.  The host simulation
+   counts every MmcCommand() there, where perf.mmcCommands counts the
+   read commands only, and times power off up to RealPowerOff(). */
+const u_int16 perfActions[] = {
+    PERF_BOOT, ke_next, ke_previous, ke_bookNext, ke_bookPrev, ke_OT_NT,
+    ke_markNext, ke_markPrev, ke_back, PERF_POWEROFF
+};
+#define PERF_ACTIONS (sizeof(perfActions) / sizeof(perfActions[0]))
+
+struct {
+    u_int16 event;          /* perfActions[] entry measured */
+    u_int16 measuring;
+    u_int32 time;
+    struct PERFCOUNT start;
+} perfAction;
+
+/* Start measuring event if it is one of perfActions[]. */
+void PerfActionStart(u_int16 event) {
+    register u_int16 i;
+
+    for (i = 0; i < PERF_ACTIONS; i++) {
+        if (perfActions[i] == event) {
+            perfAction.event = event;
+            perfAction.measuring = 1;
+            perfAction.time = event == PERF_BOOT ? 0 : ReadTimeCount();
+            memcpy(&perfAction.start, &perf, sizeof(perf));
+            return;
+        }
+    }
+}
+
+/* Print the cost of the action being measured as one line of event,
+   sectors, commands, eeprom writes and ms. */
+void PerfActionEnd(void) {
+    u_int16 sectors, commands, writes, ms;
+
+    if (!perfAction.measuring) return;
+    perfAction.measuring = 0;
+    sectors = (u_int16)(perf.sectors - perfAction.start.sectors);
+    commands = perf.mmcCommands - perfAction.start.mmcCommands;
+    writes = perf.eeWrites - perfAction.start.eeWrites;
+    ms = (u_int16)(ReadTimeCount() - perfAction.time);
+    puthex(perfAction.event); puthex(sectors); puthex(commands);
+    puthex(writes); puthex(ms);
+    puts("=action cost");
+}
+#define PERF_ACTION(event) PerfActionStart(event)
+#define PERF_ACTION_END() PerfActionEnd()
+#else
+#define PERF_ACTION(event)
+#define PERF_ACTION_END()
+#endif
+
+#ifdef USE_BOOT_PROFILE
+#define BOOT_PHASES     8       /* phase ring size, one EEPROM page */
+enum bootPhase {
+    bpInit = 1,     /* Initialize() */
+    bpMmc,          /* InitializeMmc() */
+    bpFat,          /* InitFileSystem() */
+    bpMenu,         /* MenuInit() */
+    bpCount,        /* counting the .ogg files */
+    bpIndex,        /* book index */
+    bpEeprom,       /* reading the saved position */
+    bpOpen,         /* opening and positioning the first file */
+};
+struct {
+    u_int16 next;
+    u_int16 done;
+    u_int32 last;
+    u_int16 ring[BOOT_PHASES][2]; /* phase, milliseconds */
+} bootProfile;
+
+/* End of a boot phase: record how long it took. */
+void BootMark(u_int16 phase) {
+    register u_int32 now = ReadTimeCount();
+    register u_int16 i = bootProfile.next++ & (BOOT_PHASES - 1);
+
+    if (bootProfile.done) return;
+    bootProfile.ring[i][0] = phase;
+    bootProfile.ring[i][1] = (u_int16)(now - bootProfile.last);
+    bootProfile.last = now;
+}
+
+/* First audio: print and save the profile once per boot. */
+void BootDone(void) {
+    register u_int16 i;
+
+    if (bootProfile.done) return;
+    bootProfile.done = 1;
+    for (i = 0; i < BOOT_PHASES; i++) {
+#ifdef USE_DEBUG
+        puthex(bootProfile.ring[i][0]); puthex(bootProfile.ring[i][1]);
+        puts("=boot phase, ms");
+#endif
+    }
+#ifdef BOOT_PROFILE_EEPROM
+    SpiWritePage(PROFILE, bootProfile.ring[0], 2*BOOT_PHASES);
+#endif
+}
+#define BOOT_MARK(phase) BootMark(phase)
+#define BOOT_DONE() BootDone()
+#else
+#define BOOT_MARK(phase)
+#define BOOT_DONE()
+#endif
+
+void CacheInvalidate(void) {
+    register u_int16 i;
+    for (i = 0; i < CACHE_SLOTS; i++) {
+        cache.sector[i] = CACHE_EMPTY;
+    }
+    cache.lastMiss = CACHE_EMPTY;
+}
+
+#ifdef USE_STREAM_READ
+/* Close an open READ_MULTIPLE_BLOCK transfer with STOP_TRANSMISSION.
+   Called when the next request is not contiguous and whenever the
+   mapper goes idle, so the card is never left streaming. */
+void MmcStopStream(void) {
+    if (mmc.streaming) {
+        register u_int16 t = 65535;
+        mmc.streaming = 0;
+        MmcCommand(12|0x40/*MMC_STOP_TRANSMISSION*/, 0);
+        PERF_INC(mmcCommands);
+        /* R1b: wait while the card holds MISO low */
+        while (SpiSendReceiveMmc(0xff00, 8) != 0xff && --t != 0)
+            ;
+        SpiSendClocks();
+    }
+}
+#else
+#define MmcStopStream()
+#endif
+
 s_int16 InitializeMmc(s_int16 tries) {
     register u_int16 i;
+    u_int16 reg[9];     /* CID or CSD and its CRC; minifatBuffer may
+                           still hold a sector the mount needs */
+#ifdef USE_CARD_PROFILE
+    u_int16 known, mid, readyMs;
+    u_int32 serial;
+#endif
+#ifdef USE_DEBUG
+    u_int32 initStart = ReadTimeCount();
+#endif
     mmc.state = mmcNA;
     mmc.blocks = 0;
     mmc.errors = 0;
+#ifdef USE_STREAM_READ
+    mmc.streaming = 0; /* CMD0 below drops any open transfer */
+#endif
+    CacheInvalidate(); /* the card may have been changed */
+#ifdef USE_PREFETCH
+    prefetch.tried = -1;
+    prefetch.valid = 0;
+#endif
+
+#ifdef USE_CARD_PROFILE
+    SpiReadWords(CONFIG + CARD_PROFILE, (u_int16 *)&cardProfile, sizeof(cardProfile));
+    known = (Crc16((u_int16 *)&cardProfile, sizeof(cardProfile) - 1) == cardProfile.crc);
+#endif
 
 #if DEBUG_LEVEL > 1
     puthex(clockX);
@@ -317,6 +1495,7 @@ s_int16 InitializeMmc(s_int16 tries) {
 #endif
 tryagain:
     IdleHook();
+    PERF_INC(mmcInits);
 
     mmc.hcShift = 9;
     if (tries-- <= 0) {
@@ -366,6 +1545,12 @@ tryagain:
     i = SpiSendReceiveMmc(-1, 16);
     SpiSendReceiveMmc(-1, 16);
     if ((i & 0x00FF) != 0x00FF) goto tryagain;//return ++mmc.errors;    /*Check support voltage*/
+#endif
+    {
+#ifdef USE_CARD_PROFILE
+    register u_int32 start = ReadTimeCount();
+    register u_int16 wait = known ? cardProfile.readyMs - cardProfile.readyMs/4 : 1;
+    if (wait == 0) wait = 1;
 #endif
     while (1) {
         MmcCommand(0x40|55/*CMD55*/, 0);
@@ -391,9 +1576,49 @@ tryagain:
 #endif
             goto tryagain; /* Not able to power up mmc */
         }
+#ifdef USE_CARD_PROFILE
+        /* Poll quickly at first and back off to ACMD41_POLL_MS; a
+           known card first gets most of the time it took last time. */
+        {
+            register u_int32 t = ReadTimeCount();
+            while (ReadTimeCount() - t < wait)
+                ;
+        }
+        wait = (wait >= ACMD41_POLL_MS/2) ? ACMD41_POLL_MS : wait * 2;
+#else
         BusyWait10();
+#endif
+    }
+#ifdef USE_CARD_PROFILE
+    readyMs = (u_int16)(ReadTimeCount() - start);
+#endif
     }
 
+#ifdef USE_CARD_PROFILE
+    /* Recognise the card by its CID: MID in byte 0, PSN in bytes 9..12 */
+    mid = 0xffffU; /* no CID; a MID is one byte */
+    serial = 0;
+    if (MmcCommand(MMC_SEND_CID/*CMD10*/|0x40, 0) == 0) {
+        i = 3200;
+        while (SpiSendReceiveMmc(0xff00, 8) == 0xff) {
+            if (i-- == 0) goto tryagain;
+        }
+        for (i = 0; i < 9; i++) reg[i] = SpiSendReceiveMmc(-1, 16);
+        mid = reg[0] >> 8;
+        serial = ((u_int32)(reg[4] & 0xff) << 24) | ((u_int32)reg[5] << 8) | (reg[6] >> 8);
+#if DEBUG_LEVEL > 1
+        puthex(mid);
+        puthex(serial >> 16);
+        puthex(serial);
+        puts("=CID MID, PSN");
+#endif
+    }
+    if (known && mid == cardProfile.mid && serial == cardProfile.serial) {
+        mmc.hcShift = cardProfile.hcShift;
+        mmc.blocks = cardProfile.blocks;
+    } else
+#endif
+    {
     if (parametr) {
 #if DEBUG_LEVEL > 1
         i = MmcCommand(MMC_READ_OCR/*CMD58*/|0x40, 0);
@@ -419,7 +1644,7 @@ tryagain:
 #endif
     }
     if (MmcCommand(MMC_SEND_CSD/*CMD9*/|0x40, 0) == 0) {
-        register s_int16 *p = (s_int16 *)minifatBuffer;
+        register s_int16 *p = (s_int16 *)reg;
         i = 640;
         while (SpiSendReceiveMmc(0xff00, 8) == 0xff) {
             if (i-- == 0) {
@@ -435,14 +1660,14 @@ tryagain:
             puthex(p[-1]);
 #endif
         }
-        if ((minifatBuffer[0] & 0xf000) == 0x4000) {
+        if ((reg[0] & 0xf000) == 0x4000) {
         /* v2.0 in 512kB resolution */
-            mmc.blocks = (((((u_int32)minifatBuffer[3] << 16) | minifatBuffer[4]) & 0x3fffff) + 1) << 10;
+            mmc.blocks = (((((u_int32)reg[3] << 16) | reg[4]) & 0x3fffff) + 1) << 10;
         } else {
         /* v1.0 */
-            register u_int16 c_mult = ((minifatBuffer[4] & 3) << 1) | ((u_int16)minifatBuffer[5] >> 15);
-            register u_int32 c_size = (((minifatBuffer[3] & 0x03ff) << 2 ) | ((minifatBuffer[4] >> 14) & 3)) + 1;
-            mmc.blocks = c_size << (2 + c_mult + (minifatBuffer[2] & 15) - 9);
+            register u_int16 c_mult = ((reg[4] & 3) << 1) | ((u_int16)reg[5] >> 15);
+            register u_int32 c_size = (((reg[3] & 0x03ff) << 2 ) | ((reg[4] >> 14) & 3)) + 1;
+            mmc.blocks = c_size << (2 + c_mult + (reg[2] & 15) - 9);
         }
 #if DEBUG_LEVEL > 1
         puts("=CSD");
@@ -451,17 +1676,7 @@ tryagain:
         puts("=mmcBlocks");
 #endif
     }
-
-#if DEBUG_LEVEL > 1
-    if (MmcCommand(MMC_SEND_CID/*CMD10*/|0x40, 0) == 0) {
-        i = 3200;
-        while (SpiSendReceiveMmc(0xff00, 8) == 0xff) {
-            if (i-- == 0) goto tryagain;
-        }
-        for (i = 9; i > 0; i--) puthex(SpiSendReceiveMmc(-1, 16));
-        puts("=CID");
     }
-#endif
 
     /* Set Block Size of 512 bytes -- default for at least HC */
     /* Needed by MaxNova S043618ATA 2J310700 MV016Q-MMC */
@@ -479,12 +1694,37 @@ tryagain:
     }
 #endif
 
+#ifdef USE_CARD_PROFILE
+    /* Remember a new card, or a ready time that has drifted */
+    if (mid != 0xffffU && (!known || mid != cardProfile.mid || serial != cardProfile.serial ||
+                readyMs > cardProfile.readyMs + cardProfile.readyMs/8 + ACMD41_POLL_MS ||
+                readyMs + cardProfile.readyMs/8 + ACMD41_POLL_MS < cardProfile.readyMs)) {
+        cardProfile.mid = mid;
+        cardProfile.serial = serial;
+        cardProfile.hcShift = mmc.hcShift;
+        cardProfile.blocks = mmc.blocks;
+        cardProfile.readyMs = readyMs;
+        cardProfile.crc = Crc16((u_int16 *)&cardProfile, sizeof(cardProfile) - 1);
+        EepromQueue(CONFIG + CARD_PROFILE, (u_int16 *)&cardProfile, sizeof(cardProfile));
+    }
+#endif
+
     /* All OK return */
     //mmc.errors = 0;
     mmc.state = mmcOk;
     map->blocks = mmc.blocks;
 #ifdef USE_DEBUG
     puts("Completed MMC Init OK.");
+#ifdef USE_CARD_PROFILE
+    puthex(mid);
+    puthex((u_int16)serial);
+    puthex(readyMs);
+    puthex((u_int16)(ReadTimeCount() - initStart));
+    puts("=card MID, PSN, ACMD41 ms, init ms");
+#else
+    puthex((u_int16)(ReadTimeCount() - initStart));
+    puts("=init ms");
+#endif
 #endif
     return 0;//mmc.errors;
     }
@@ -493,7 +1733,10 @@ tryagain:
 
 auto u_int16 MyReadDiskSector(register __i0 u_int16 *buffer, register __reg_a u_int32 sector) {
     register s_int16 i;
-    register u_int16 t = 65535;
+    register u_int16 t;
+#ifdef USE_FAST_RECOVERY
+    register u_int16 retry = MMC_READ_RETRIES;
+#endif
 
     if (mmc.state == mmcNA || mmc.errors) {
         cs.cancel = 1;
@@ -504,15 +1747,52 @@ auto u_int16 MyReadDiskSector(register __i0 u_int16 *buffer, register __reg_a u_
     puthex(sector);
     puts("=ReadDiskSector");
 #endif
+#ifdef USE_FAST_RECOVERY
+again:
+#endif
+#ifdef USE_STREAM_READ
+    /* An isolated read, such as a FAT or directory lookup, is one
+       READ_SINGLE_BLOCK: a READ_MULTIPLE_BLOCK would cost a
+       STOP_TRANSMISSION and its busy wait as well.  The second
+       contiguous read opens a READ_MULTIPLE_BLOCK and keeps it open
+       while the requests stay sequential, which saves the command,
+       its response and the extra clocks for every sector after it. */
+    if (!mmc.streaming || sector != mmc.next) {
+        MmcStopStream();
+        if (sector == mmc.next) {
+            MmcCommand(18|0x40/*MMC_READ_MULTIPLE_BLOCK*/, sector << mmc.hcShift);
+            mmc.streaming = 1;
+        } else {
+            MmcCommand(MMC_READ_SINGLE_BLOCK|0x40, sector << mmc.hcShift);
+        }
+        PERF_INC(mmcCommands);
+    }
+#else
     MmcCommand(MMC_READ_SINGLE_BLOCK|0x40, sector << mmc.hcShift);
+    PERF_INC(mmcCommands);
+#endif
+    t = 65535;
     do {
         i = SpiSendReceiveMmc(0xff00, 8);
     } while (i == 0xff && --t != 0);
+    PERF_ADD(tokenPolls, 65536L - t);
 
     if (i != 0xfe) {
+        MmcStopStream();
+#ifdef USE_FAST_RECOVERY
+        if (i != 0xff && retry--) {
+            /* an error token: read it again, with a new command.  After
+               a full timeout the card is gone or hung, and polling
+               another 65535 times only delays the re-initialisation. */
+            recovery.retries++;
+            SpiSendClocks();
+            goto again;
+        }
+#endif
         memset(buffer, 0, 256);
         if (i > 15 /*unknown error code*/) {
             mmc.errors++;
+            PERF_INC(mmcErrors);
 #if 0
         putch('R');
 #endif
@@ -532,19 +1812,73 @@ auto u_int16 MyReadDiskSector(register __i0 u_int16 *buffer, register __reg_a u_
         *buffer++ = SpiSendReceiveMmc(0xffff, 16);
     }
     SpiSendReceiveMmc(0xffff, 16); /* discard crc */
+    PERF_INC(sectors);
+#ifdef USE_STREAM_READ
+    mmc.next = sector + 1;
+    if (!mmc.streaming) /* else the card starts on the next block */
+#endif
+    {
+        /* generate some extra SPI clock edges to finish up the command */
+        SpiSendClocks();
+        SpiSendClocks();
+    }
+    return 0; /* All OK return */
+}
+
+#ifdef USE_SECTOR_CACHE
+s_int16 CacheFind(u_int32 sector) {
+    register s_int16 i;
+    for (i = 0; i < CACHE_SLOTS; i++) {
+        if (cache.sector[i] == sector) return i;
+    }
+    return -1;
+}
 
-    /* generate some extra SPI clock edges to finish up the command */
-    SpiSendClocks();
-    SpiSendClocks();
+/* Return the slot holding sector, reading it into the least recently
+   used slot on a miss.  A failed read leaves the slot zeroed and
+   tagged CACHE_EMPTY. */
+u_int16 CacheLoad(u_int32 sector) {
+    register s_int16 i = CacheFind(sector);
 
-    /* We force a call of user interface after each block even if we
-        have no idle CPU. This prevents problems with key response in
-        fast play mode. */
-    IdleHook();
-    return 0; /* All OK return */
+    if (i >= 0) {
+        cache.hits++;
+    } else {
+        register u_int16 j;
+        i = 0;
+        for (j = 1; j < CACHE_SLOTS; j++) {
+            if ((s_int16)(cache.age[j] - cache.age[i]) < 0) i = j;
+        }
+        cache.misses++;
+        cache.lastMiss = sector;
+        cache.sector[i] = sector;
+        if (MyReadDiskSector(cache.buffer[i], sector)) {
+            cache.sector[i] = CACHE_EMPTY;
+            memset(cache.buffer[i], 0, 256);
+        }
+    }
+    cache.age[i] = ++cache.clock;
+    return i;
+}
+
+u_int16 *CacheRead(u_int32 sector) {
+    return cache.buffer[CacheLoad(sector)];
+}
+#else
+/* The menu sector buffer: the sector is read when another one is
+   wanted. */
+u_int16 *CacheRead(u_int32 sector) {
+    if (cache.sector[0] != sector) {
+        cache.sector[0] = sector;
+        if (MyReadDiskSector(cache.buffer[0], sector)) {
+            cache.sector[0] = CACHE_EMPTY;
+        }
+    }
+    return cache.buffer[0];
 }
+#endif
 
 u_int16 FsMapMmcRead(struct FsMapper *map, u_int32 firstBlock, u_int16 blocks, u_int16 *data);
+s_int16 FsMapMmcFlush(struct FsMapper *map, u_int16 hard);
 
 const struct FsMapper mmcMapper = {
     0x010c,         /*version*/
@@ -556,7 +1890,7 @@ const struct FsMapper mmcMapper = {
     FsMapMmcRead, 
     NULL,           //FsMapMmcWrite, 
     NULL,           //FsMapFlNullOk, //RamMapperFree, 
-    FsMapFlNullOk,  //RamMapperFlush, 
+    FsMapMmcFlush,  //RamMapperFlush, 
     NULL            /* no physical */
 };
 
@@ -567,8 +1901,52 @@ u_int16 FsMapMmcRead(struct FsMapper *map, u_int32 firstBlock, u_int16 blocks, u
     firstBlock &= 0x00ffffff; /*remove sign extension: 4G -> 8BG limit*/
 #endif
     while (bl < blocks) {
+#ifdef USE_PREFETCH
+        if (prefetch.opening && AudioBufFill() < PREFETCH_MIN_FILL) {
+            prefetch.opening = 2; /* give up before the audio runs out */
+            break;
+        }
+#endif
+#ifdef USE_VOLUME_KEY
+        if (firstBlock - extent.fatStart < extent.fatSectors) extent.fatReads++;
+#endif
+#ifdef USE_SECTOR_CACHE
+        if (firstBlock != cache.lastMiss + 1 || CacheFind(firstBlock) >= 0) {
+            /* Cached, or a random access such as a FAT or directory
+               lookup: go through the cache. */
+            register u_int16 slot = CacheLoad(firstBlock);
+            memcpy(data, cache.buffer[slot], 256);
+            if (cache.sector[slot] != firstBlock)
+            break; /* probably MMC detached */
+        } else {
+            /* Sequential streaming goes straight to the caller so the
+               audio data does not evict the metadata. */
+            cache.lastMiss = firstBlock;
+            if (MyReadDiskSector(data, firstBlock))
+            break; /* probably MMC detached */
+        }
+#else
         if (MyReadDiskSector(data, firstBlock))
         break; /* probably MMC detached */
+#endif
+#ifdef USE_RESUME_SEEK
+        if (splice.head) {
+            if (firstBlock == splice.head) SectorBlank(data, splice.headEnd, 512);
+            if (firstBlock == splice.tail) SectorBlank(data, 0, splice.tailStart);
+        }
+#endif
+        /* We force a call of user interface after each block even if we
+            have no idle CPU. This prevents problems with key response in
+            fast play mode.  It comes after the block is in data: a key
+            handler may read menu sectors through the cache and evict
+            the slot it was copied from. */
+#ifdef USE_PREFETCH
+        prefetch.inRead++;
+        IdleHook();
+        prefetch.inRead--;
+#else
+        IdleHook();
+#endif
         data += 256;
         firstBlock++;
         bl++;
@@ -576,12 +1954,20 @@ u_int16 FsMapMmcRead(struct FsMapper *map, u_int32 firstBlock, u_int16 blocks, u
     return bl;
 }
 
+/* Mapper idle: end the multi-block transfer. */
+s_int16 FsMapMmcFlush(struct FsMapper *map, u_int16 hard) {
+    MmcStopStream();
+    return 0;
+}
+
 
 #if defined(PATCH_TEST_UNIT_READY) && defined(PATCH_LBAB)
 void ScsiTestUnitReady(void) {
     /* Poll MMC present by giving it a command. */
+    MmcStopStream();
     if (mmc.state == mmcOk && mmc.errors == 0 && MmcCommand(MMC_SET_BLOCKLEN|0x40, 512) != 0) {
         mmc.errors++;
+        PERF_INC(mmcErrors);
     }
     if (mmc.state == mmcNA || mmc.errors) {
         SCSI.Status = SCSI_REQUEST_ERROR; /* report error at least once! */
@@ -589,39 +1975,204 @@ void ScsiTestUnitReady(void) {
 }
 #endif
 
+#ifdef USE_KEY_QUEUE
+/* Tick: queue the key state when it has been stable for
+   KEY_DEBOUNCE_MS and differs from the last one queued. */
+void KeySample(void) {
+    register u_int16 keys = PERIP(GPIO0_IDATA) & KEY_GPIO_MASK;
+
+    if (PERIP(SCI_STATUS) & SCISTF_REGU_POWERBUT) keys |= KEY_POWER;
+    if (keys != keyQueue.raw) {
+        keyQueue.raw = keys;
+        keyQueue.stable = 0;
+        return;
+    }
+    if (keyQueue.stable < KEY_DEBOUNCE_MS && ++keyQueue.stable == KEY_DEBOUNCE_MS &&
+        keys != keyQueue.state) {
+        register u_int16 h = keyQueue.head;
+        if (((h + 1) & (KEY_QUEUE - 1)) == keyQueue.tail) {
+            keyQueue.stable = 0; /* full: try again later */
+            return;
+        }
+        keyQueue.entry[h].keys = keys;
+        keyQueue.entry[h].time = ticks;
+        keyQueue.state = keys;
+        keyQueue.head = (h + 1) & (KEY_QUEUE - 1);
+    }
+}
+
+/* Send the short press of keys through currentKeyMap, as KeyScan9()
+   does on a release. */
+void KeyShortPress(u_int16 keys) {
+    register const struct KeyMapping *k;
+
+    for (k = currentKeyMap; k->key; k++) {
+        if (k->key == keys) {
+            KeyEventHandler((enum keyEvent)(k->event & ~KEY_LONG_ONESHOT));
+            return;
+        }
+    }
+}
+
+/* Idle hook: take the queued changes; returns non-zero if there were
+   any, i.e. KeyScan9() should run now.  A press that KeyScan9() has
+   not held in keyOld by the time its release is taken is mapped here
+   as a short press. */
+u_int16 KeyDrain(void) {
+    register u_int16 t = keyQueue.tail;
+
+    if (keyOld) keyQueue.down = 0; /* seen, KeyScan9() maps it */
+    if (t == keyQueue.head) return 0;
+    while (t != keyQueue.head) {
+        register u_int16 keys = keyQueue.entry[t].keys;
+#ifdef USE_KEY_LATENCY
+        keyLatency.pending = 1;
+        keyLatency.stamp = keyQueue.entry[t].time;
+#endif
+        if (keys) {
+            keyQueue.down |= keys;
+        } else {
+            if (keyQueue.down && !keyOld) KeyShortPress(keyQueue.down);
+            keyQueue.down = 0;
+        }
+        t = (t + 1) & (KEY_QUEUE - 1);
+    }
+    keyQueue.tail = t;
+    return 1;
+}
+
+#ifdef USE_KEY_LATENCY
+void KeyLatencyRecord(void) {
+    if (keyLatency.pending) {
+        register u_int16 ms = ticks - keyLatency.stamp;
+        register u_int16 b = 0;
+        keyLatency.pending = 0;
+        while (ms && b < KEY_LATENCY_BUCKETS - 1) {
+            ms >>= 1;
+            b++;
+        }
+        keyLatency.histogram[b]++;
+    }
+}
+
+/* Upper bound in ms of the bucket holding the pct'th percentile, i.e.
+   the percentile is at most this; 0xffff for the last bucket. */
+u_int16 KeyLatencyPercentile(u_int16 pct) {
+    register u_int32 total = 0, need, sum = 0;
+    register u_int16 b;
+
+    for (b = 0; b < KEY_LATENCY_BUCKETS; b++) total += keyLatency.histogram[b];
+    need = (total * pct + 99) / 100;
+    for (b = 0; b < KEY_LATENCY_BUCKETS - 1; b++) {
+        sum += keyLatency.histogram[b];
+        if (sum >= need) return (1 << b) - 1;
+    }
+    return 0xffff;
+}
+#endif
+#endif
+
+#ifdef USE_TICK
+/* Arm action to run in ms milliseconds and then every period ms, or
+   only once if period is 0.  Not for use from the tick itself. */
+void Defer(u_int16 action, u_int16 ms, u_int16 period) {
+    PERIP(INT_ENABLEL) &= ~INTF_TIM1;
+    deferred.left[action] = ms;
+    deferred.period[action] = period;
+    PERIP(INT_ENABLEL) |= INTF_TIM1;
+}
+
+/* Timer1 counts clockX/2 times SYSTEMMAINFREQ: set its reload for
+   TICKFREQ at the current clockX.  The idle hook calls it again
+   whenever LoadCheck() has changed clockX.  Without the tick Timer1
+   keeps the fixed reload it always had. */
+void TimerReload(void) {
+    register u_int32 n = clockX * (SYSTEMMAINFREQ / 2 / TICKFREQ) - 1;
+
+    timerClockX = clockX;
+    PERIP(TIMER_T1L) = (u_int16)n;
+    PERIP(TIMER_T1H) = (u_int16)(n >> 16);
+}
+#endif
+
+/* Leave the playing file for player.nextFile, remembering where it was
+   for ke_back. */
+void Jump(void) {
+    cs.cancel = 1;
+    repeat = 0;
+    prejump_file = player.currentFile;
+    prejump_playtime = (u_int16)cs.playTimeSeconds;
+    beep();
+}
+
+/* Turn the amp off and cancel the file once the beep has been heard. */
+void CancelAfterBeep(void) {
+#ifdef USE_TICK
+    Defer(daJump, BEEP_MS, 0);
+#else
+    jumpAt = ((u_int16)ReadTimeCount() + BEEP_MS) | 1;
+#endif
+}
+
 void MyKeyEventHandler(enum keyEvent event) { /*140 words*/
+    u_int16 mark[16];
+#ifdef USE_BOOK_INDEX
+    register u_int16 i;
+#else
     register const struct MENUENTRY *m;
-    register u_int16 subtree, parent, i;
+    register u_int16 subtree, parent;
+#endif
 
+    PERF_ACTION(event);
+#ifdef USE_KEY_LATENCY
+    KeyLatencyRecord();
+#endif
     /* separate the small-numbered cases */
     switch (event) {
+#ifdef USE_BOOK_INDEX
+        case ke_bookPrev:
+            if (playingBook > 0) {
+                player.nextFile = bookIndex.first[playingBook-1];
+            } else {
+                player.nextFile = bookIndex.first[bookIndex.books-1];
+            }
+            Jump();
+            break;
+        case ke_bookNext:
+            if (playingBook + 1 < bookIndex.books) {
+                player.nextFile = bookIndex.first[playingBook+1];
+            } else {
+                player.nextFile = 0;
+            }
+            Jump();
+            break;
+        case ke_OT_NT:
+            i = TestamentOf(playingBook) + 1;
+            if (i < bookIndex.testaments) {
+                player.nextFile = bookIndex.first[bookIndex.testamentFirst[i]];
+            } else {
+                player.nextFile = 0;
+            }
+            Jump();
+            break;
+#else
         case ke_bookPrev:
             if (playingEntry.parent > book1) {
                 m = (struct MENUENTRY *)MenuGetEntry(playingEntry.parent-1);
             } else {
                 m = (struct MENUENTRY *)MenuGetEntry(offset-1);
             }
-            subtree = m->subtree;
-            player.nextFile = subtree - offset;
-            cs.cancel = 1;
-            repeat = 0;
-            prejump_file = player.currentFile;
-            prejump_playtime = (u_int16)cs.playTimeSeconds;
-            beep();
+            player.nextFile = m->subtree - offset;
+            Jump();
             break;
         case ke_bookNext:
             if (playingEntry.parent < offset-1) {
                 m = (struct MENUENTRY *)MenuGetEntry(playingEntry.parent+1);
-                subtree = m->subtree;
-                player.nextFile = subtree - offset;
+                player.nextFile = m->subtree - offset;
             } else {
                 player.nextFile = 0;
             }
-            cs.cancel = 1;
-            repeat = 0;
-            prejump_file = player.currentFile;
-            prejump_playtime = (u_int16)cs.playTimeSeconds;
-            beep();
+            Jump();
             break;
         case ke_OT_NT:
             m = (struct MENUENTRY *)MenuGetEntry(playingEntry.parent);
@@ -637,54 +2188,44 @@ void MyKeyEventHandler(enum keyEvent event) { /*140 words*/
                 subtree = m->subtree;
             }
             player.nextFile = parent - offset;
-            cs.cancel = 1;
-            repeat = 0;
-            prejump_file = player.currentFile;
-            prejump_playtime = (u_int16)cs.playTimeSeconds;
-            beep();
+            Jump();
             break;
+#endif
         case ke_previous:
             if (player.currentFile==0) player.nextFile = player.totalFiles - 1;
             else player.nextFile = player.currentFile - 1;
-            cs.cancel = 1;
-            repeat = 0;
-            prejump_file = player.currentFile;
-            prejump_playtime = (u_int16)cs.playTimeSeconds;
-            beep();
+            Jump();
             break;
         case ke_next:
             if (player.currentFile == player.totalFiles - 1) player.nextFile = 0;
             else player.nextFile = player.currentFile + 1;
-            cs.cancel = 1;
-            repeat = 0;
-            prejump_file = player.currentFile;
-            prejump_playtime = (u_int16)cs.playTimeSeconds;
-            beep();
+            Jump();
             break;
         case ke_pauseToggle:
+            MmcStopStream(); /* no reads while paused */
             player.pauseOn ^= 1;
             PERIP(GPIO0_ODATA) ^= AMP;
             break;
         case ke_bookmark:
             beep();
-            SpiWrite(BOOKMARKS + bookmark, player.currentFile);
-            SpiWrite(BOOKMARKS + bookmark + 2, (u_int16)cs.playTimeSeconds);
+            mark[0] = player.currentFile;
+            mark[1] = (u_int16)cs.playTimeSeconds;
+            EepromQueue(BOOKMARKS + bookmark, mark, 2);
             bookmark = (bookmark + 4) & 0x1f;
             break;
         case ke_markPrev:
             bookmark -= 8;
         case ke_markNext:
             beep();
-            for (i = 20; i > 0; i-- ) BusyWait10();
-            PERIP(GPIO0_ODATA) &= ~AMP; /* amp off */
             bkmk_pressed = 1;
             bookmark = (bookmark + 4) & 0x1f;
-            player.nextFile = SpiRead(BOOKMARKS + bookmark);
-            goTo = SpiRead(BOOKMARKS + bookmark + 2);
-            cs.cancel = 1;
+            SpiReadWords(BOOKMARKS + bookmark, mark, 2);
+            player.nextFile = mark[0];
+            goTo = mark[1];
             repeat = 0;
             prejump_file = player.currentFile;
             prejump_playtime = (u_int16)cs.playTimeSeconds;
+            CancelAfterBeep();
             break;
         case ke_repeat:
             player.nextFile = player.currentFile;
@@ -693,39 +2234,311 @@ void MyKeyEventHandler(enum keyEvent event) { /*140 words*/
             break;
         case ke_resetBookmarks:
             beep();
-            for (i = 0; i < 32; i += 2) {
-                SpiWrite(BOOKMARKS + i, 0);
-            }
+            memset(mark, 0, sizeof(mark));
+            EepromQueue(BOOKMARKS, mark, 16); /* the whole page */
             break;
         case ke_back:
             beep();
-            for (i = 20; i > 0; i-- ) BusyWait10();
-            PERIP(GPIO0_ODATA) &= ~AMP; /* amp off */
             bkmk_pressed = 1;
             player.nextFile = prejump_file;
             goTo = prejump_playtime;
-            cs.cancel = 1;
             repeat = 0;
+            CancelAfterBeep();
             break;
         default:
             RealKeyEventHandler(event);
     }
+#ifdef USE_PERF_COUNT
+#ifdef USE_TICK
+    if (cs.cancel || deferred.left[daJump]) PerfKeyStart();
+#else
+    if (cs.cancel || jumpAt) PerfKeyStart();
+#endif
+#endif
+}
+
+/* Forget the contiguous files of the previous mount and find the FATs
+   of the new one. */
+void ExtentReset(void) {
+#ifdef USE_EXTENTS
+    register u_int16 i;
+    for (i = 0; i < EXTENT_FILES; i++) extent.file[i] = -1;
+    extent.next = 0;
+#endif
+#ifdef USE_VOLUME_KEY
+    FatBounds();
+#endif
+}
+
+/* OpenFile() that serves a contiguous file opened before from the
+   extent table, and keeps newly opened contiguous files there. */
+s_int16 ExtentOpen(s_int16 file) {
+#ifdef USE_EXTENTS
+    register u_int16 i;
+    register s_int16 ret;
+
+    for (i = 0; i < EXTENT_FILES; i++) {
+        if (extent.file[i] == file) {
+            memcpy(&minifatInfo, extent.info[i], sizeof(minifatInfo));
+            minifatInfo.currentSector = CACHE_EMPTY; /* not what it held */
+            minifatFragments[0].start = extent.start[i];
+            minifatFragments[0].size = extent.size[i];
+            extent.hits++;
+            return -1;
+        }
+    }
+    ret = OpenFile(file);
+#ifdef USE_PREFETCH
+    if (prefetch.opening > 1) return 0; /* a read failed, the list may be cut */
+#endif
+    if (ret < 0 && (minifatFragments[0].start & FRAG_LAST)) {
+        i = extent.next;
+        extent.next = (i + 1) % EXTENT_FILES;
+        extent.file[i] = file;
+        extent.start[i] = minifatFragments[0].start;
+        extent.size[i] = minifatFragments[0].size;
+        memcpy(extent.info[i], &minifatInfo, sizeof(minifatInfo));
+    }
+    return ret;
+#else
+    return OpenFile(file);
+#endif
+}
+
+#ifdef USE_PREFETCH
+/* The file the play loop opens for player.nextFile: past either end
+   of the list it starts again from the first. */
+s_int16 PrefetchFile(void) {
+    register s_int16 next = player.nextFile;
+    if (next < 0 || next >= player.totalFiles) next = 0;
+    return next;
+}
+
+/* Open the next file ahead of time and put the playing file back.
+   Only called when minifat is not in the middle of a read.  Only the
+   fragment list and file info are kept; the first sector is left to
+   the decoder.  The opening reads FAT and directory sectors into
+   minifatBuffer, so the sector it held for the playing file is read
+   again afterwards. */
+void PrefetchNext(void) {
+    register s_int16 next = PrefetchFile();
+    register u_int32 held = minifatInfo.currentSector;
+
+    prefetch.tried = next;
+    prefetch.valid = 0;
+    if (player.totalFiles == 0) return;
+    memcpy(prefetch.saveInfo, &minifatInfo, sizeof(minifatInfo));
+    memcpy(prefetch.saveFragments, minifatFragments, sizeof(minifatFragments));
+    prefetch.opening = 1;
+    if (ExtentOpen(next) < 0 && prefetch.opening == 1) {
+        memcpy(prefetch.info, &minifatInfo, sizeof(minifatInfo));
+        memcpy(prefetch.fragments, minifatFragments, sizeof(minifatFragments));
+        prefetch.valid = 1;
+    }
+    prefetch.opening = 0;
+    held = (minifatInfo.currentSector == held) ? CACHE_EMPTY : held;
+    memcpy(&minifatInfo, prefetch.saveInfo, sizeof(minifatInfo));
+    memcpy(minifatFragments, prefetch.saveFragments, sizeof(minifatFragments));
+    if (held != CACHE_EMPTY && MyReadDiskSector(minifatBuffer, held)) {
+        minifatInfo.currentSector = CACHE_EMPTY; /* minifat reads it */
+    }
+}
+
+/* OpenFile() for the main loop, served from the prefetch if it has
+   the file. */
+s_int16 OpenNextFile(s_int16 file) {
+    register u_int16 hit = prefetch.valid && file == prefetch.tried;
+
+    prefetch.tried = -1;
+    prefetch.valid = 0;
+    if (hit) {
+        memcpy(&minifatInfo, prefetch.info, sizeof(minifatInfo));
+        memcpy(minifatFragments, prefetch.fragments, sizeof(minifatFragments));
+        minifatInfo.currentSector = CACHE_EMPTY; /* not what it held */
+        return -1;
+    }
+    return ExtentOpen(file);
+}
+#else
+#define OpenNextFile(file) ExtentOpen(file)
+#endif
+
+#ifdef USE_AUDIO_METER
+/* A file starts playing: forget the headroom of the previous one. */
+void AudioLoadStart(void) {
+    audioLoad.primed = 0;
+    audioLoad.empty = 0;
+    audioLoad.minFill = audioLoad.windowMin = AUDIO_FILL_MAX;
+    audioLoad.underruns = 0;
+}
+
+/* Note the audio buffer fill.  Called from the Timer1 tick with
+   USE_TICK, so that a decoder busy on a long page is still sampled
+   every millisecond, else from the idle hook. */
+void AudioLoadSample(void) {
+    register u_int16 fill = AudioBufFill();
+
+    if (!audioLoad.primed) {
+        /* the buffer starts empty; wait for the decoder to get ahead */
+        if (fill < AUDIO_FILL_MAX/2) return;
+        audioLoad.primed = 1;
+    }
+    if (fill < audioLoad.minFill) audioLoad.minFill = fill;
+    if (fill < audioLoad.windowMin) audioLoad.windowMin = fill;
+    if (fill == 0) {
+        if (!audioLoad.empty) {
+            audioLoad.empty = 1;
+            audioLoad.underruns++;
+            audioLoad.totalUnderruns++;
+        }
+    } else {
+        audioLoad.empty = 0;
+    }
+}
+
+/* Fill as a percentage of the buffer. */
+u_int16 AudioHeadroom(u_int16 fill) {
+    return (u_int16)((u_int32)fill * 100 / AUDIO_FILL_MAX);
+}
+#endif
+
+#ifdef USE_CLOCK_GOVERNOR
+/* Headroom percentage since the last call, for the clock policy;
+   100 until the buffer has filled up. */
+u_int16 AudioWindowHeadroom(void) {
+    register u_int16 h = AudioHeadroom(audioLoad.windowMin);
+    audioLoad.windowMin = AUDIO_FILL_MAX;
+    return h;
+}
+
+/* A file was opened: lift the cap and pick the step-down threshold
+   from the nominal bitrate of its identification header. */
+void GovernorFile(void) {
+    register const u_int16 *p = CacheRead(minifatFragments[0].start & 0x7fffffffUL);
+    register u_int32 bitrate = SectorLong(p, 27 + SectorByte(p, 26) + 20);
+
+    governor.ceiling = GOV_CLOCKX_MAX;
+    governor.hold = 0;
+    governor.decided = governor.counted = ReadTimeCount();
+    governor.high = (bitrate && bitrate <= GOV_SPEECH_BITRATE) ?
+        GOV_HIGH_SPEECH : GOV_HIGH_MUSIC;
+}
+
+/* Hooked over LoadCheck(), which the decoder calls between frames of
+   PlayCurrentFile() in the main context.  The ROM's LoadCheck() writes
+   clockX and calls SetRate() from there too, so the cap is set the
+   same way and is as safe: no interrupt handler reads clockX, no SPI
+   transfer to the card or the EEPROM is under way (both are only
+   driven from the main context), and with USE_TICK the Timer1 reload
+   follows the new clockX at the next idle hook (TimerReload()), as it
+   does after the ROM's own changes. */
+void MyLoadCheck(struct CodecServices *cs, s_int16 n) {
+    register u_int32 now;
+    register u_int16 before = clockX;
+
+    RealLoadCheck(cs, n);
+    now = ReadTimeCount();
+    if (playing && !player.pauseOn &&
+        now - governor.decided >= GOV_PERIOD) {
+        register u_int16 h = AudioWindowHeadroom();
+        governor.decided = now;
+        if (h < GOV_TARGET || audioLoad.underruns) {
+            governor.ceiling = GOV_CLOCKX_MAX;
+            governor.hold = GOV_HOLD;
+        } else if (governor.hold) {
+            governor.hold--;
+        } else if (h > governor.high && clockX > GOV_CLOCKX_MIN) {
+            governor.ceiling = clockX - 1;
+        }
+    }
+    if (playing && clockX > governor.ceiling) {
+        if (clockX > before) {
+            /* LoadCheck() raised it: the decoder is falling behind, so
+               keep its clock rather than set it back and forth */
+            governor.ceiling = GOV_CLOCKX_MAX;
+            governor.hold = GOV_HOLD;
+        } else {
+            clockX = governor.ceiling;
+            SetRate(hwSampleRate); /* reprogram the clock as LoadCheck() does */
+        }
+    }
+    /* time played at each clock, from the first call after GovernorFile() */
+    if (playing && !player.pauseOn) {
+        governor.msAt[governor.clockX] += now - governor.counted;
+    }
+    governor.counted = now;
+    governor.clockX = clockX > GOV_CLOCKX_MAX ? GOV_CLOCKX_MAX : clockX;
 }
+#endif
 
 void MyUserInterfaceIdleHook(void) { /*94 words*/
+#ifdef USE_PERF_COUNT
+    perf.idleCalls++;
+    if (clockX != perfClockX) {
+        perfClockX = clockX;
+        perf.clockChanges++;
+    }
+#endif
+#if defined(USE_AUDIO_METER) && !defined(USE_TICK)
+    if (playing && !player.pauseOn && !cs.cancel) {
+        AudioLoadSample();
+    }
+#endif
+#ifdef USE_CLOCK_GOVERNOR
+    if (player.pauseOn) governor.counted = ReadTimeCount(); /* not played */
+#endif
+#ifdef USE_TICK
+    if (clockX != timerClockX) TimerReload();
+#endif
+    if (!battery_low) PowerOff(); /* flat, seen by BatteryCheck() */
+#ifndef USE_TICK
+    if (jumpAt && (s_int16)((u_int16)ReadTimeCount() - jumpAt) >= 0) {
+        jumpAt = 0;
+        PERIP(GPIO0_ODATA) &= ~AMP; /* amp off */
+        cs.cancel = 1;
+    }
+#endif
+#ifdef USE_KEY_QUEUE
+    if (KeyDrain() || uiTrigger) {
+#else
     if (uiTrigger) {
+#endif
         uiTrigger = 0;
         KeyScan9();
+#ifdef USE_KEY_LATENCY
+        keyLatency.pending = 0; /* no event for it, e.g. a long press */
+#endif
+    }
+#ifdef USE_PREFETCH
+    if (playing && !prefetch.inRead && !cs.cancel &&
+        prefetch.tried != PrefetchFile()) {
+        PrefetchNext();
+    }
+#endif
+#ifdef USE_EEPROM_QUEUE
+    EepromStep();
+#endif
+#ifdef USE_JOURNAL
+    if (playing && (u_int16)cs.playTimeSeconds != journal.second) {
+        journal.second = (u_int16)cs.playTimeSeconds;
+        if (++journal.played >= AUTOSAVE_SECONDS) {
+            journal.played = 0;
+            JournalSave();
+        }
     }
+#endif
 }
 
 auto void MyPowerOff(void) {
     register u_int16 i;
-    SpiWrite(CONFIG + CHAPTER, player.currentFile); /* save current chapter */
-    SpiWrite(CONFIG + SECONDS, (u_int16)cs.playTimeSeconds); /* and time */
-    if (player.volume > VOL_MIN) player.volume = VOL_MIN;
-    SpiWrite(CONFIG + VOLUME, player.volume);   /* save current volume */
-    SpiWrite(CONFIG + BOOKMARK, bookmark);  /* save current bookmark */
+    PERF_ACTION(PERF_POWEROFF);
+    MmcStopStream();
+    JournalSave(); /* save chapter, time, volume and bookmark */
+    EepromFlush();
+    PERF_ACTION_END();
+#ifdef USE_PERF_COUNT
+    PerfSave();
+#endif
     PERIP(INT_ENABLEL) &= ~INTF_TIM1;   /*Disable interrupt TIM1*/
     i = PERIP(GPIO0_ODATA);
     i &= ~AMP;     // amp off
@@ -735,15 +2548,16 @@ auto void MyPowerOff(void) {
     RealPowerOff();
 }
 
-void InterruptHandler_Timer1(void) {
+void BatteryCheck(void) {
     register u_int16 i;
-    PERIP(INT_ENABLEL) &= ~INTF_TIM1;   /*Disable interrupt TIM1*/
     if (PERIP(SCI_STATUS) & SCISTF_REGU_POWERLOW) {
 #ifdef USE_DEBUG
         puts("=LOW");
 #endif
-        i = battery_low - 1;
-        if (!i) PowerOff(); /* check the 60seconds */
+        i = battery_low;
+        /* At 0 the idle hook or the main loop powers off: MyPowerOff()
+           writes the eeprom and must not run in this interrupt. */
+        if (i) i--;
         if (i < 60) {
             beep();
             PERIP(GPIO0_ODATA) ^= BAT_LED;
@@ -756,6 +2570,43 @@ void InterruptHandler_Timer1(void) {
 #endif
     }
     battery_low = i;
+}
+
+void InterruptHandler_Timer1(void) {
+#ifdef USE_TICK
+    register u_int16 i;
+#endif
+    PERIP(INT_ENABLEL) &= ~INTF_TIM1;   /*Disable interrupt TIM1*/
+#ifdef USE_TICK
+    ticks++;
+#ifdef USE_KEY_QUEUE
+    KeySample();
+#endif
+#ifdef USE_AUDIO_METER
+    if (playing && !player.pauseOn && !cs.cancel) {
+        AudioLoadSample();
+    }
+#endif
+    for (i = 0; i < DEFERRED_ACTIONS; i++) {
+        if (deferred.left[i] && --deferred.left[i] == 0) {
+            deferred.left[i] = deferred.period[i];
+            switch (i) {
+                case daBattery:
+                    BatteryCheck();
+                    break;
+                case daJump:
+                    PERIP(GPIO0_ODATA) &= ~AMP; /* amp off */
+                    cs.cancel = 1;
+                    break;
+                case daLed:
+                    PERIP(GPIO0_ODATA) ^= BAT_LED;
+                    break;
+            }
+        }
+    }
+#else
+    BatteryCheck();
+#endif
     PERIP(INT_ENABLEL) |= INTF_TIM1;
 }
 
@@ -803,17 +2654,29 @@ void Initialize(void) {
     SetHookFunction((u_int16)KeyEventHandler, MyKeyEventHandler);
     SetHookFunction((u_int16)IdleHook, MyUserInterfaceIdleHook);
     SetHookFunction((u_int16)PowerOff, MyPowerOff);
+#ifdef USE_CLOCK_GOVERNOR
+    SetHookFunction((u_int16)LoadCheck, MyLoadCheck);
+#endif
 
+#ifdef USE_TICK
+    TimerReload(); //Timer1 at TICKFREQ, See Page74
+    PERIP(TIMER_T1CNTL) = PERIP(TIMER_T1L); //Current Value Low
+    PERIP(TIMER_T1CNTH) = PERIP(TIMER_T1H); //Current Value High
+#else
     {
-        register u_int16 low = SYSTEMMAINFREQ / BATTERYCHECKFREQ;
-        register u_int16 high = SYSTEMMAINFREQ / BATTERYCHECKFREQ >> 16;
+        register u_int16 low = SYSTEMMAINFREQ / TICKFREQ;
+        register u_int16 high = SYSTEMMAINFREQ / TICKFREQ >> 16;
 
         PERIP(TIMER_T1L) = low; //default main clock is 6MHz See Page74
         PERIP(TIMER_T1H) = high; //change to 1Hz
         PERIP(TIMER_T1CNTL) = low; //Current Value Low
         PERIP(TIMER_T1CNTH) = high; //Current Value High
     }
+#endif
     SetInterruptVector_Timer1();
+#ifdef USE_TICK
+    Defer(daBattery, BATTERYCHECK_MS, BATTERYCHECK_MS);
+#endif
     PERIP(TIMER_ENABLE) |= (1 << 1); //Enable timer 1
 
 #if 1 /*Perform some extra inits because we are started from SPI boot. */
@@ -853,12 +2716,20 @@ void Initialize(void) {
 
 void main(void) {
     register const struct MENUENTRY *m;
+#ifdef USE_DEBUG
+    u_int32 gapStart = 0;
+#endif
 
 #ifdef USE_DEBUG
     puts("Entered main()");
 #endif
 
     Initialize();
+#ifdef USE_PERF_COUNT
+    PerfLoad();
+#endif
+    PERF_ACTION(PERF_BOOT);
+    BOOT_MARK(bpInit);
 
     {   // Check button lock and power off if locked
         register u_int16 i;
@@ -875,6 +2746,22 @@ void main(void) {
             puts("InitializeMmc(50)");
 #endif
             InitializeMmc(50);
+            PERF_INC(mmcReinits);
+            BOOT_MARK(bpMmc);
+#ifdef USE_FAST_RECOVERY
+            if (recovery.pending && mmc.state == mmcOk && !mmc.errors) {
+                u_int16 key[3];
+                VolumeKey(key);
+                if (!mmc.errors && !memcmp(key, recovery.key, 3)) {
+                    /* same card: keep the mount, resume where it stopped */
+                    recovery.pending = 0;
+                    recovery.tier = 2;
+                    player.nextFile = recovery.file;
+                    goTo = recovery.seconds;
+                    goto resume;
+                }
+            }
+#endif
         }
 
 #ifdef USE_DEBUG
@@ -882,6 +2769,17 @@ void main(void) {
 #endif
     /* Try to init FAT. */
         if (InitFileSystem() == 0) {
+            BOOT_MARK(bpFat);
+#ifdef USE_TICK
+            Defer(daLed, 0, 0); /* stop the no card blinking */
+#endif
+            ExtentReset();
+#ifdef USE_FAST_RECOVERY
+            if (recovery.pending) {
+                recovery.pending = 0;
+                recovery.tier = 3;
+            }
+#endif
 #ifdef USE_DEBUG
             puts("FAT init ok.");
 #endif
@@ -896,13 +2794,18 @@ void main(void) {
 #endif
                 while (1) {;} // No menu found
             }
+            BOOT_MARK(bpMenu);
 #ifdef USE_DEBUG
             puts("Done MenuInit()...");
 #endif
 
             /* Restore the default suffixes. */
             minifatInfo.supportedSuffixes = oggFiles;
-            player.totalFiles = OpenFile(0xffffU);
+            player.totalFiles = CountFiles();
+#ifdef USE_FAST_RECOVERY
+            VolumeKey(recovery.key);
+#endif
+            BOOT_MARK(bpCount);
 
             if (player.totalFiles == 0) {
                 /* If no files found, output some samples.
@@ -922,30 +2825,44 @@ void main(void) {
             offset = m->subtree;
 
             {
-                register u_int16 subtree, offsetlastbook = offset - 1;
-                m = (struct MENUENTRY *)MenuGetEntry(offsetlastbook);
-                subtree = m->subtree;
-                do {
-                    m = (struct MENUENTRY *)MenuGetEntry(subtree);
-                    subtree++;
-                } while (m->parent == offsetlastbook);
-                if (player.totalFiles > (subtree - offset)) player.totalFiles = subtree - offset;
+                register u_int16 end = MenuFilesEnd();
+                if (player.totalFiles > end) player.totalFiles = end;
+#ifdef USE_BOOK_INDEX
+                BookIndexInit(end);
+#endif
             }
+            BOOT_MARK(bpIndex);
 
             player.pauseOn = 0;
             player.nextStep = 1;
 #ifdef USE_DEBUG
             puts("About to read eeprom...");
 #endif
-            player.nextFile = SpiRead(CONFIG + CHAPTER);    /* read saved chapter */
-            goTo = SpiRead(CONFIG + SECONDS);       /* read saved playTimeSeconds */
-            player.volume = SpiRead(CONFIG + VOLUME);   /* read saved volume */
-            if (player.volume > VOL_MIN) player.volume = VOL_MIN;
-            bookmark = SpiRead(CONFIG + BOOKMARK) & 0x1C;// read saved bookmark
+            {
+                u_int16 config[4];
+                if (!JournalLoad(config)) {
+                    /* nothing journalled: the fixed config words */
+                    SpiReadWords(CONFIG + CHAPTER, config, 4);
+                }
+                player.nextFile = config[CHAPTER/2];    /* read saved chapter */
+                goTo = config[SECONDS/2];       /* read saved playTimeSeconds */
+                player.volume = config[VOLUME/2];   /* read saved volume */
+                if (player.volume > VOL_MIN) player.volume = VOL_MIN;
+                bookmark = config[BOOKMARK/2] & 0x1C;// read saved bookmark
+            }
+            BOOT_MARK(bpEeprom);
 #ifdef USE_DEBUG
             puthex(player.nextFile); puts("=SpiRead");
+#endif
+#ifdef USE_FAST_RECOVERY
+resume:
 #endif
             while (1) {
+#ifdef USE_TICK
+                /* drop a jump armed for the file that has just ended,
+                   before it can mute or cancel the next one */
+                Defer(daJump, 0, 0);
+#endif
                 PERIP(GPIO0_ODATA) |= AMP; /* amp on */
                 player.currentFile = player.nextFile;
                 if ((player.currentFile < 0) || (player.currentFile >= player.totalFiles)) {
@@ -954,10 +2871,29 @@ void main(void) {
 #endif
                     player.currentFile = 0;
                 }
+#ifdef USE_FAST_RECOVERY
+                recovery.file = player.currentFile;
+                recovery.seconds = (goTo == 0xffffU) ? 0 : goTo;
+#endif
                 player.nextFile = player.currentFile + 1 - repeat;
 
                 /* If the file can be opened, start playing it. */
-                if (OpenFile(player.currentFile) < 0) {
+                if (OpenNextFile(player.currentFile) < 0) {
+#ifdef USE_CLOCK_GOVERNOR
+                    GovernorFile();
+#endif
+#ifdef USE_RESUME_SEEK
+                    splice.head = splice.tail = 0;
+                    if (goTo != 0xffffU && goTo != 0) {
+                        u_int32 audioStart;
+                        register u_int32 page = SeekIndexLookup(player.currentFile, goTo, &audioStart);
+                        if (page && !(OggPageAt(page) && OggPageAt(audioStart))) {
+                            page = 0; /* not this file's index */
+                        }
+                        if (!page) page = OggBisect(goTo, &audioStart);
+                        if (page) ResumeSplice(audioStart, page);
+                    }
+#endif
                     player.ffCount = 0;
                     cs.cancel = 0;
                     cs.goTo = goTo; /* start playing from saved place */
@@ -965,15 +2901,82 @@ void main(void) {
                     cs.fastForward = 1; /* reset play speed to normal */
 #ifdef USE_DEBUG
                     puthex(player.currentFile); puts("=player.currentFile");
+#ifdef USE_SECTOR_CACHE
+                    puthex(cache.hits); puthex(cache.misses); puts("=cache hits, misses");
+#endif
+#ifdef USE_PERF_COUNT
+                    PerfPrint();
 #endif
+#ifdef USE_KEY_LATENCY
+                    puthex(KeyLatencyPercentile(50));
+                    puthex(KeyLatencyPercentile(99));
+                    puts("=key latency p50, p99 at most ms");
+#endif
+#endif
+#ifdef USE_BOOK_INDEX
+                    playingBook = BookOf(player.currentFile);
+#else
                     m = (struct MENUENTRY *)MenuGetEntry(player.currentFile + offset);
                     memcpy(&playingEntry, m, sizeof(playingEntry));
+#endif
 
                     {
                         register s_int16 oldStep = player.nextStep;
                         register s_int16 ret;
 
+#ifdef USE_DEBUG
+                        puthex(ReadTimeCount() - gapStart); puts("=gap ms");
+#endif
+#if defined(USE_DEBUG) && defined(USE_FAST_RECOVERY)
+                        if (recovery.tier) {
+                            puthex(recovery.tier);
+                            puthex((u_int16)(ReadTimeCount() - recovery.time));
+                            puthex(recovery.retries);
+                            puts("=recovery tier, ms, sector retries");
+                            recovery.tier = 0;
+                        }
+#endif
+                        BOOT_MARK(bpOpen);
+                        BOOT_DONE();
+                        PERF_ACTION_END();
+#ifdef USE_PERF_COUNT
+                        PerfKeyEnd();
+#endif
+#ifdef USE_AUDIO_METER
+                        AudioLoadStart();
+#endif
+                        playing = 1;
                         ret = PlayCurrentFile();
+                        playing = 0;
+#ifdef USE_FAST_RECOVERY
+                        recovery.seconds = (u_int16)cs.playTimeSeconds;
+#endif
+#ifdef USE_DEBUG
+                        gapStart = ReadTimeCount();
+#ifdef USE_AUDIO_METER
+                        puthex(player.currentFile);
+                        puthex(AudioHeadroom(audioLoad.minFill));
+                        puthex(audioLoad.underruns);
+                        puthex(audioLoad.totalUnderruns);
+                        puts("=file, headroom %, underruns, total");
+#endif
+#ifdef USE_CLOCK_GOVERNOR
+                        {
+                            register u_int16 i;
+                            for (i = GOV_CLOCKX_MIN; i <= GOV_CLOCKX_MAX; i++) {
+                                puthex(i);
+                                puthex((u_int16)(governor.msAt[i] / 1000));
+                                puts("=clockX, s");
+                            }
+                        }
+#endif
+                        puthex(player.currentFile);
+                        puthex(extent.fatReads);
+                        puthex(extent.hits);
+                        puts("=file, FAT sectors, extent hits");
+                        extent.fatReads = 0;
+#endif
+                        MmcStopStream();
 
                         /* If unsupported, keep skipping */
                         if (ret == ceFormatNotFound) player.nextFile = player.currentFile + player.nextStep;
@@ -982,7 +2985,13 @@ void main(void) {
                     }
                 }
                 /* Leaves play loop when MMC changed */
-                if (mmc.state == mmcNA || mmc.errors) break;
+                if (mmc.state == mmcNA || mmc.errors) {
+#ifdef USE_FAST_RECOVERY
+                    recovery.pending = 1;
+                    recovery.time = ReadTimeCount();
+#endif
+                    break;
+                }
 
                 if (bkmk_pressed) {
                     bkmk_pressed = 0;
@@ -998,7 +3007,17 @@ noFSnorFiles:
             puts("FAT init failed.");
 #endif
             LoadCheck(&cs, 32); /* decrease or increase clock */
+#ifdef USE_TICK
+            if (clockX != timerClockX) TimerReload();
+#endif
+            if (!battery_low) PowerOff();
+#ifdef USE_TICK
+            if (!deferred.left[daLed]) {
+                Defer(daLed, LED_BLINK_MS, LED_BLINK_MS); /* flash LED */
+            }
+#else
             PERIP(GPIO0_ODATA) ^= BAT_LED;  /* flash LED */
+#endif
         }
     }
 }
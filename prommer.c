@@ -4,6 +4,7 @@
 #include <fat.h>
 #include <player.h>
 #include <dev1000.h>
+#include "lzdec.h"
 
 #define PAGESIZE        32
 #define SECTORSIZE      512
@@ -49,21 +50,41 @@ void SpiWaitStatus(void) {
     SPI_MASTER_8BIT_CSHI; 
 }
 
+/// Poll the status register once; non-zero while a write cycle runs
+u_int16 SpiBusy(void) {
+    u_int16 status;
+
+    SPI_MASTER_8BIT_CSHI;
+    SpiDelay(0);
+    SPI_MASTER_8BIT_CSLO;
+    SpiSendReceive(SPI_EEPROM_COMMAND_READ_STATUS_REGISTER);
+    status = SpiSendReceive(0xff);
+    SPI_MASTER_8BIT_CSHI;
+    return status & 0x01;
+}
+
+/// Send one page; the write cycle starts when xCS goes high
+void SpiWritePage(u_int16 addr, register u_int16 *dptr) {
+    SingleCycleCommand(SPI_EEPROM_COMMAND_WRITE_ENABLE);
+    SPI_MASTER_8BIT_CSLO;
+    SpiSendReceive(SPI_EEPROM_COMMAND_WRITE);
+    SPI_MASTER_16BIT_CSLO;
+    SpiSendReceive(addr);
+    {
+        register u_int16 j;
+        for (j = PAGESIZE/2; j > 0; j--) SpiSendReceive(*dptr++);
+    }
+    SPI_MASTER_8BIT_CSHI;
+}
+
 void SpiWriteBlock(register u_int16 blockn, register u_int16 *dptr) {
     u_int16 i;
     register u_int16 addr = blockn*512;
 
     for (i = SECTORSIZE/(PAGESIZE); i > 0; i--){
-        SingleCycleCommand(SPI_EEPROM_COMMAND_WRITE_ENABLE);
-        SPI_MASTER_8BIT_CSLO;
-        SpiSendReceive(SPI_EEPROM_COMMAND_WRITE);
-        SPI_MASTER_16BIT_CSLO;
-        SpiSendReceive(addr);
-        {
-            register u_int16 j;
-            for (j = PAGESIZE/2; j > 0; j--) SpiSendReceive(*dptr++);
-        }
+        SpiWritePage(addr, dptr);
         SpiWaitStatus();
+        dptr += PAGESIZE/2;
         addr += PAGESIZE;
     }
 }
@@ -96,43 +117,195 @@ void puthex(u_int16 d) {
 }
 #endif
 
+u_int16 bootBuffer[SECTORSIZE/2];   /* sector 0 of eeprom.img, written last */
+u_int16 verifyBuffer[SECTORSIZE/2]; /* eeprom contents for comparison */
+u_int16 packBuffer[LZ_MAX_PACKED];  /* one packed sector of eeprom.lz */
+u_int16 sectorBuffer[SECTORSIZE/2]; /* receives a sector while minifatBuffer
+                                       is programmed, and vice versa */
+
+/* The sector being programmed.  Its pages are issued one at a time
+   whenever the EEPROM is idle, in between the serial reads of the next
+   sector, so the write cycles overlap with the transfer. */
+struct PROGRAM {
+    u_int16 *data;      /* 0 when nothing is pending */
+    u_int16 blockn;
+    u_int16 page;       /* next page to send */
+    u_int16 skipped, written, failed;
+} program;
+
+/// Send the next page of the pending sector if the EEPROM is idle
+void ProgramStep(void) {
+    if (program.data && program.page < SECTORSIZE/PAGESIZE && !SpiBusy()) {
+        SpiWritePage(program.blockn*SECTORSIZE + program.page*PAGESIZE,
+                     program.data + program.page*(PAGESIZE/2));
+        program.page++;
+    }
+}
+
+/// Queue a sector for programming; the previous one must be finished
+void ProgramStart(u_int16 blockn, u_int16 *dptr) {
+    program.data = dptr;
+    program.blockn = blockn;
+    program.page = 0;
+    ProgramStep();
+}
+
+/// Write the rest of the pending sector, read it back and report it
+void ProgramFinish(void) {
+    if (!program.data) return;
+    while (program.page < SECTORSIZE/PAGESIZE) ProgramStep();
+    SpiReadBlock(program.blockn, verifyBuffer); // waits for the last page
+#ifdef DEBUG
+    fputs("Sector ", stdout);
+    puthex(program.blockn);
+#endif
+    if (memcmp(program.data, verifyBuffer, SECTORSIZE/2)) {
+#ifdef DEBUG
+        puts(" VERIFY FAILED");
+#endif
+        program.failed++;
+    } else {
+#ifdef DEBUG
+        puts(" written");
+#endif
+        program.written++;
+    }
+    program.data = 0;
+}
+
+/// Read and unpack the next sector of eeprom.lz; returns its length in
+/// words, 0 at the end of the file or 0xffff if the file is corrupt.
+/// lzpack never writes an empty sector, so one is corrupt too.
+u_int16 ReadSector(FILE *fp, u_int16 *dptr) {
+    u_int16 words, got = 0;
+
+    if (fread(&words, 1, 1, fp) != 1) return 0;
+    if (words == 0 || words > LZ_MAX_PACKED) goto corrupt;
+    while (got < words) {
+        u_int16 n = words - got;
+        if (n > PAGESIZE/2) n = PAGESIZE/2;
+        if (fread(packBuffer + got, 1, n, fp) != n) goto corrupt;
+        got += n;
+        ProgramStep();
+    }
+    words = LzDecode(packBuffer, words, dptr);
+    if (words == 0 || words > SECTORSIZE/2) goto corrupt;
+    return words;
+corrupt:
+    puts("eeprom.lz is corrupt!");
+    return 0xffff;
+}
+
+/// Invalidate the boot id before the first sector that changes
+u_int16 EraseFirstSector(void) {
+#ifdef DEBUG
+    puts("Erase first sector...");
+#endif
+    memset(verifyBuffer, 0, SECTORSIZE/2);
+    SpiWriteBlock(0, verifyBuffer);
+    SpiReadBlock(0, verifyBuffer);
+#ifdef DEBUG
+    puthex(verifyBuffer[0]); 
+    puts("\n");
+#endif
+    if (verifyBuffer[0] != 0x0000) {
+#ifdef DEBUG
+        puts("Can't erase EEPROM!");
+#endif
+        return 1;
+    }
+    return 0;
+}
+
 void WriteEEPROM(void) {
     FILE *fp;
     PERIP(INT_ENABLEL) &= ~INTF_RX;
 #ifdef DEBUG
-    puts("Trying to open eeprom.img");
+    puts("Trying to open eeprom.lz");
 #endif
-    if (fp = fopen ("eeprom.img", "rb")) {
+    if (fp = fopen ("eeprom.lz", "rb")) {
         u_int16 len;
         u_int16 sectorNumber = 0;
-
+        u_int16 erased = 0;
+        u_int16 *buffer = minifatBuffer;
 #ifdef DEBUG
-        puts("Erase first sector...");
+        u_int32 startTime = ReadTimeCount();
 #endif
-        memset(minifatBuffer, 0, SECTORSIZE/2);
-        SpiWriteBlock(sectorNumber, minifatBuffer);
-        SpiReadBlock(0, minifatBuffer);
+
+        /* Sectors that already match are skipped.  Sector 0 holds the
+           boot id: it is erased before the first sector that has to
+           be programmed and written back last, so an interrupted run
+           never leaves a bootable half-old image. */
+        len = ReadSector(fp, bootBuffer);
+        if (len == 0) puts("eeprom.lz is empty!");
+        if (len == 0 || len == 0xffff) goto done;
+        SpiReadBlock(0, verifyBuffer);
+        memcpy(bootBuffer + len, verifyBuffer + len, SECTORSIZE/2 - len);
+        if (memcmp(bootBuffer, verifyBuffer, SECTORSIZE/2)) {
+            if (EraseFirstSector()) goto done;
+            erased = 1;
+        }
 #ifdef DEBUG
-        puthex(minifatBuffer[0]); 
-        puts("\n");
+        puts("Programming...");
 #endif
-        if (minifatBuffer[0] != 0x0000) {
+        program.skipped = program.written = program.failed = 0;
+        while ((len = ReadSector(fp, buffer)) != 0){
+            if (len == 0xffff) {
+                ProgramFinish();
+                goto done;  // sector 0 stays erased rather than half-new
+            }
+            sectorNumber++;
+            ProgramFinish();
+            SpiReadBlock(sectorNumber, verifyBuffer);
+            /* keep whatever follows a short last sector */
+            memcpy(buffer + len, verifyBuffer + len, SECTORSIZE/2 - len);
+            if (!memcmp(buffer, verifyBuffer, SECTORSIZE/2)) {
 #ifdef DEBUG
-            puts("Can't erase EEPROM!");
+                fputs("Sector ", stdout);
+                puthex(sectorNumber);
+                puts(" same");
 #endif
-            return;
+                program.skipped++;
+                continue;
+            }
+            if (!erased) {
+                if (EraseFirstSector()) goto done;
+                erased = 1;
+            }
+            ProgramStart(sectorNumber, buffer);
+            buffer = (buffer == minifatBuffer) ? sectorBuffer : minifatBuffer;
         }
+        ProgramFinish();
+
+        if (!erased) {
 #ifdef DEBUG
-        puts("Programming...");
-#endif
-        while ((len = fread(minifatBuffer, 1, SECTORSIZE/2, fp))){
             fputs("Sector ", stdout);
-            puthex(sectorNumber);
-            puts("...");
-            SpiWriteBlock(sectorNumber, minifatBuffer);
-            sectorNumber++;
+            puthex(0);
+            puts(" same");
+#endif
+            program.skipped++;
+        } else if (program.failed) {
+            puts("Sector 0000 left erased");    // never boot a bad image
+        } else {
+            ProgramStart(0, bootBuffer);
+            ProgramFinish();
+        }  // Programming complete.
+
+#ifdef DEBUG
+        puthex(program.skipped);
+        fputs(" skipped, ", stdout);
+        puthex(program.written);
+        fputs(" written, ", stdout);
+        puthex(program.failed);
+        puts(" failed");
+        {
+            u_int32 ms = ReadTimeCount() - startTime;
+            fputs("Programming took ", stdout);
+            puthex((u_int16)(ms >> 16));
+            puthex((u_int16)ms);
+            puts(" ms (hex)");
         }
-        fclose(fp);  // Programming complete.
+#endif
 
         minifatBuffer[0]=0;
 #ifdef DEBUG
@@ -154,6 +327,8 @@ void WriteEEPROM(void) {
         }
         puts("Done.");
 #endif
+    done:
+        fclose(fp);
     } else {
 #ifdef DEBUG
         puts("File not found\n");
@@ -0,0 +1,186 @@
+/*
+ * seekidx.c - Build SEEK.IDX, the resume seek table for OSAB cards.
+ *
+ * Copyright (C) 2011-2020 Theophilus (http://theaudiobible.org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * Usage: seekidx [-i seconds] SEEK.IDX file.ogg...
+ *
+ * The .ogg files must be given in play order, i.e. menu order.
+ *
+ * SEEK.IDX is made of big-endian 16-bit words, as the VS1000 reads them:
+ *   word 0..7   "SKIX", version (1), interval in seconds, number of
+ *               files, sector of the first entry, 0, 0
+ *   word 8..    files+1 32-bit entry indices; file f owns entries
+ *               dir[f] .. dir[f+1]-1
+ *   entries     from the entry sector on, 4 words each: 32-bit byte
+ *               offset of the page to resume from, 32-bit granule
+ *               position at which that page's audio starts.
+ * Entry k of a file is the last page whose audio starts at or before
+ * k * interval seconds.  Entry 0 is therefore the first audio page,
+ * which also tells the firmware where the Vorbis headers end.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SECTORWORDS     256
+#define INTERVAL        30
+
+static unsigned long get32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | ((unsigned long)p[2] << 16) | ((unsigned long)p[3] << 24);
+}
+
+static void put16(FILE *fp, unsigned int w) {
+    putc((w >> 8) & 0xff, fp);
+    putc(w & 0xff, fp);
+}
+
+static void put32(FILE *fp, unsigned long l) {
+    put16(fp, l >> 16);
+    put16(fp, l & 0xffff);
+}
+
+struct entry {
+    unsigned long offset;
+    unsigned long granule;
+};
+
+static struct entry *entries;
+static unsigned long nEntries, maxEntries;
+
+static void addEntry(unsigned long offset, unsigned long granule) {
+    if (nEntries == maxEntries) {
+        maxEntries = maxEntries ? 2 * maxEntries : 4096;
+        entries = realloc(entries, maxEntries * sizeof(*entries));
+        if (!entries) {
+            fputs("seekidx: out of memory\n", stderr);
+            exit(1);
+        }
+    }
+    entries[nEntries].offset = offset;
+    entries[nEntries].granule = granule;
+    nEntries++;
+}
+
+/* Add the entries of one .ogg file. */
+static int indexFile(const char *name, unsigned int interval) {
+    FILE *fp = fopen(name, "rb");
+    unsigned char *buf;
+    long size, pos = 0;
+    unsigned long step = 0, next = 0, prev = 0, lastStart = 0;
+    long lastPos = -1;
+
+    if (!fp) {
+        perror(name);
+        return -1;
+    }
+    fseek(fp, 0, SEEK_END);
+    size = ftell(fp);
+    rewind(fp);
+    buf = malloc(size ? size : 1);
+    if (!buf || fread(buf, 1, size, fp) != (size_t)size) {
+        fprintf(stderr, "seekidx: cannot read %s\n", name);
+        fclose(fp);
+        free(buf);
+        return -1;
+    }
+    fclose(fp);
+
+    while (pos + 27 <= size && !memcmp(buf + pos, "OggS", 4)) {
+        const unsigned char *h = buf + pos;
+        unsigned int nseg = h[26], i;
+        long len = 27 + nseg;
+        unsigned long granule = get32(h + 6);
+        int noGranule = get32(h + 6) == 0xffffffffUL && get32(h + 10) == 0xffffffffUL;
+
+        if (pos + len > size) break;
+        for (i = 0; i < nseg; i++) len += h[27 + i];
+        if (pos + len > size) break;
+        if (pos == 0 && len >= 27 + nseg + 16 && !memcmp(h + 27 + nseg, "\001vorbis", 7)) {
+            step = get32(h + 27 + nseg + 12) * interval; /* rate * interval */
+        }
+        if (step && (lastPos >= 0 || (granule && !noGranule))) {
+            /* The audio of this page starts at prev, so the previous
+               audio page is the resume point of every step before it. */
+            if (lastPos >= 0) {
+                while (next < prev) {
+                    addEntry(lastPos, lastStart);
+                    next += step;
+                }
+            }
+            lastPos = pos;
+            lastStart = prev;
+        }
+        if (!noGranule) prev = granule;
+        pos += len;
+    }
+    if (lastPos >= 0) {
+        while (next <= prev) {
+            addEntry(lastPos, lastStart);
+            next += step;
+        }
+    }
+    free(buf);
+    if (!step) {
+        fprintf(stderr, "seekidx: %s is not Ogg Vorbis\n", name);
+        return -1;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    unsigned int interval = INTERVAL, files, f, entrySector;
+    unsigned long *dir, w;
+    FILE *fp;
+    int arg = 1;
+
+    if (argc > 2 && !strcmp(argv[1], "-i")) {
+        interval = atoi(argv[2]);
+        arg = 3;
+    }
+    if (argc - arg < 2 || interval == 0) {
+        fputs("Usage: seekidx [-i seconds] SEEK.IDX file.ogg...\n", stderr);
+        return 1;
+    }
+    files = argc - arg - 1;
+    dir = malloc((files + 1) * sizeof(*dir));
+    if (!dir) return 1;
+    for (f = 0; f < files; f++) {
+        dir[f] = nEntries;
+        if (indexFile(argv[arg + 1 + f], interval)) return 1;
+    }
+    dir[files] = nEntries;
+
+    if (!(fp = fopen(argv[arg], "wb"))) {
+        perror(argv[arg]);
+        return 1;
+    }
+    entrySector = (8 + 2 * (files + 1) + SECTORWORDS - 1) / SECTORWORDS;
+    put16(fp, 0x534b);  /* "SK" */
+    put16(fp, 0x4958);  /* "IX" */
+    put16(fp, 1);
+    put16(fp, interval);
+    put16(fp, files);
+    put16(fp, entrySector);
+    put16(fp, 0);
+    put16(fp, 0);
+    for (f = 0; f <= files; f++) put32(fp, dir[f]);
+    for (w = 8 + 2 * (files + 1); w < entrySector * SECTORWORDS; w++) put16(fp, 0);
+    for (w = 0; w < nEntries; w++) {
+        put32(fp, entries[w].offset);
+        put32(fp, entries[w].granule);
+    }
+    fclose(fp);
+    printf("%u files, %lu entries, %u s interval\n", files, nEntries, interval);
+    return 0;
+}
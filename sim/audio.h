@@ -0,0 +1,2 @@
+/* audio.h for the host simulation, see hostsim.h */
+#include "hostsim.h"
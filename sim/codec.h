@@ -0,0 +1,2 @@
+/* codec.h for the host simulation, see hostsim.h */
+#include "hostsim.h"
@@ -0,0 +1,2 @@
+/* dev1000.h for the host simulation, see hostsim.h */
+#include "hostsim.h"
@@ -0,0 +1,2014 @@
+/*
+ * hostsim.c - Run osab.c on the host against a simulated VS1000 ROM,
+ *             SD card and SPI EEPROM.
+ *
+ * Copyright (C) 2011-2020 Theophilus (http://theaudiobible.org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * Usage: hostsim [options]
+ *   -s script     replay script (see below), default: play 10 s
+ *   -c card.img   play from this FAT16/FAT32 image instead of a
+ *                 generated one
+ *   -o card.img   save the generated image
+ *   -e eeprom.bin EEPROM contents, read at start and written back
+ *   -n files      chapters on the generated card (24)
+ *   -t seconds    length of each chapter (150)
+ *   -b bitrate    nominal bits/s of the chapters (32000)
+ *   -x            put SEEK.IDX on the generated card
+ *   -f n          split every n'th chapter in two fragments
+ *   -d n          put chapters n and on in a subdirectory, BOOK
+ *   -u            delete the last chapter as a PC does: free its
+ *                 entry and clusters and update FSInfo (MENU.MNU
+ *                 still lists it)
+ *   -j            hide a false "OggS" in every 8th audio page
+ *   -i serial     CID serial number of the card (a different card)
+ *   -l us         card read access time (500)
+ *   -w            print the EEPROM write cycles of every page
+ *   -r report.csv write every measurement as item,metric,value,budget,status
+ *   -g budget     the most each action may cost; exit 1 when over
+ *   -T sectors    only measure sequential and random sector reads
+ *
+ * The firmware (osab.c, built with sim/ on the include path) runs as
+ * on the board: main() boots, mounts the generated card and plays.
+ * Time is simulated, so runs are repeatable.  The CPU runs at
+ * 6 MHz * clockX; every ROM call, SPI transfer and decoded sample
+ * costs cycles at that rate, and the DAC drains the audio buffer in
+ * real (simulated) time, so the firmware's clock, buffer and key
+ * timing show the same interplay as on the board.  The ROM parts are
+ * models, not the ROM:
+ *   - the SD card answers the SPI mode commands the firmware sends,
+ *     with a read access time, a busy time after STOP_TRANSMISSION
+ *     and a time to become ready after the first ACMD41;
+ *   - the EEPROM is a 25xx640 with 32-byte pages and a 5 ms write
+ *     cycle, and counts the cycles of each page;
+ *   - minifat reads the FAT and directories through map->Read() into
+ *     minifatBuffer, and keeps the sector there (currentSector);
+ *   - PlayCurrentFile() reads the file through minifatBuffer, checks
+ *     every Ogg page's CRC and resynchronises after a bad one as
+ *     libogg does, skips pages before cs.goTo, and decodes the rest
+ *     at a cost in cycles per sample that grows with the bitrate.
+ *     Bytes outside pages, such as the zeros of a resume splice, are
+ *     passed over by the capture pattern search, so only the bytes of
+ *     the pages it takes count as corrupt when they are not the
+ *     card's;
+ *   - LoadCheck() raises clockX when the audio buffer runs low and
+ *     lowers it when it stays full;
+ *   - KeyScan9() maps keys through currentKeyMap with a 1 s long
+ *     press.
+ *
+ * Script lines (# starts a comment):
+ *   play ms                 keep playing for ms
+ *   key label keys hold     press keys (4, 1+3, power, ...) for hold
+ *                           ms and measure until audio plays again
+ *   glitch label n          the next n sector reads get an error token
+ *   remove label ms         the card stops answering for ms and comes
+ *                           back uninitialised
+ *   battery low|ok          the regulator's battery low flag
+ * A label of - only presses.  Boot is measured as "boot".  A key is
+ * measured from the key event it causes to the first audio of the file
+ * (re)started for it or after the pause it ends, a fault from the first
+ * access that fails to the first audio after a good sector read.  Each
+ * action is printed with the ms, sectors, commands, FAT sectors, EEPROM
+ * write cycles and MMC bus bytes it cost in that time, and the recovery
+ * tier the firmware took (1: retried, 2: card re-initialised,
+ * 3: remounted).  With -g, the run fails if an action with a budget
+ * costs more or never reaches audio.
+ */
+
+#define HOSTSIM_C
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <setjmp.h>
+#include <unistd.h>
+#include "hostsim.h"
+
+typedef uint64_t u_int64;
+
+#define NS_PER_MS       1000000ULL
+#define MAINFREQ        6000000UL   /* CPU Hz per clockX step */
+#define UI_TRIGGER_MS   10          /* KeyScan9() requests from Timer0 */
+#define LONG_PRESS_MS   1000
+#define REPEAT_MS       200
+#define ACTION_TIMEOUT_MS 10000
+#define AUDIO_FRAMES    (DEFAULT_AUDIO_BUFFER_SAMPLES / 2)
+#define DECODE_CHUNK    256         /* samples decoded between checks */
+#define NONE            0xffffffffUL
+#define CLOCKX_MAX      8
+#define FRAG_LAST       0x80000000UL  /* as in osab.c */
+
+/* Cost model, in CPU cycles unless noted */
+#define CALL_CYCLES     20          /* a ROM call */
+#define MMC_BIT_CYCLES  5           /* bit-banged SPI, per bit */
+#define EE_BIT_CYCLES   24          /* SPI0 at CLKDIV 12 */
+#define ISR_CYCLES      60
+#define PAGE_CYCLES     2           /* per byte of an Ogg page skipped */
+#define EE_WRITE_NS     (5 * NS_PER_MS)
+#define CARD_READY_MS   120         /* first ACMD41 to ready */
+#define CARD_REG_NS     100000ULL   /* CID/CSD token */
+#define CARD_NEXT_NS    20000ULL    /* next block of a multiple read */
+#define CARD_BUSY_NS    100000ULL   /* after STOP_TRANSMISSION */
+
+/* ROM variables */
+struct PLAYER player;
+struct CodecServices cs;
+struct MINIFATINFO minifatInfo;
+struct FRAGMENT minifatFragments[MAX_FRAGMENTS];
+u_int16 minifatBuffer[256];
+struct FsMapper *map;
+struct FsPhysical *ph;
+struct Codec *cod;
+u_int16 codecVorbis[1];
+u_int16 SCSI[32];      /* struct SCSIVARS, which only osab.c declares */
+const struct KeyMapping *currentKeyMap;
+u_int16 keyOld;
+s_int16 keyOldTime;
+u_int16 uiTrigger;
+u_int16 clockX = 2;
+u_int32 hwSampleRate = 44100;
+u_int16 voltages[voltEnd];
+s_int16 audioBuffer[DEFAULT_AUDIO_BUFFER_SAMPLES];
+
+/* osab.c */
+void osab_main(void);
+void Initialize(void);
+s_int16 InitializeMmc(s_int16 tries);
+void InterruptHandler_Timer1(void);
+
+static struct {
+    u_int16 files, seconds, fragEvery, seekIdx, falseCapture, wear;
+    u_int32 bitrate, rate, serial;
+    u_int64 accessNs;
+    u_int16 subdir, unlink;
+} opt = {24, 150, 0, 0, 0, 0, 32000, 16000, 0x1a2b3c4d, 500000, 0, 0};
+
+/* Totals; an action reports the difference. */
+struct COUNTERS {
+    u_int64 ns;
+    u_int32 sectors;        /* data blocks the card sent */
+    u_int32 commands;       /* MmcCommand() calls */
+    u_int32 fatSectors;     /* FAT sectors minifat read */
+    u_int32 eeWrites;       /* EEPROM write cycles */
+    u_int32 mmcBytes;       /* bytes clocked on the MMC bus */
+    u_int32 cmd0;           /* card initialisations */
+    u_int32 fsInits;        /* InitFileSystem() calls */
+};
+static struct {
+    u_int64 now;            /* ns since power on */
+    struct COUNTERS c;
+    u_int32 idleCalls;
+    u_int32 clockSets;      /* SetRate() calls */
+    u_int32 underruns;      /* buffer ran dry while playing */
+    u_int32 faultUnderruns; /* the same during a card fault */
+    u_int32 badPages;       /* pages failing the CRC */
+    u_int32 badFiles;       /* audio before the Vorbis headers */
+    u_int32 corrupt;        /* bytes of good pages that are not the
+                               card's, or read from minifatBuffer when it
+                               is not the sector minifat thinks it holds */
+    u_int32 files;          /* files started */
+    u_int32 cardFiles;      /* chapters on the generated card, 0 for -c */
+    u_int64 listenNs;       /* audio played */
+    u_int64 clockNs[CLOCKX_MAX + 1];
+    u_int64 gapFrom;        /* when the last file's audio ran out */
+    u_int64 gapMax, gapSum;
+    u_int32 gaps;
+} sim;
+
+static jmp_buf simExit;
+static u_int16 regs[HOST_REGISTERS];
+static u_int16 keysDown;            /* GPIO0 keys and KEY_POWER */
+static u_int16 batteryLow;
+
+/* ---- Time ---- */
+
+static u_int64 nextTick, nextUi, scriptWake;
+static u_int16 tickPending, inIsr, inScript;
+static double audioFill;            /* frames in the audio buffer */
+static u_int16 audioPlaying;        /* PlayCurrentFile() is outputting */
+static u_int16 audioPrimed;
+static u_int16 poweringOff;
+static void ScriptRun(void);
+static void ActionArm(u_int16 fault);
+static void ActionHit(u_int16 fault);
+static u_int16 ActionFault(void);
+static void ActionAudio(void);
+
+static u_int64 CpuHz(void) {
+    return (u_int64)MAINFREQ * (clockX ? clockX : 2);
+}
+
+static u_int64 TickNs(void) {
+    u_int64 reload = regs[TIMER_T1L] | ((u_int32)regs[TIMER_T1H] << 16);
+    return (reload + 1) * 1000000000ULL / (CpuHz() / 2);
+}
+
+/* Let the DAC play until t. */
+static void AudioDrain(u_int64 t) {
+    double frames = (double)(t - sim.now) * hwSampleRate / 1e9;
+
+    if (audioPlaying && !player.pauseOn) {
+        sim.listenNs += t - sim.now;
+        if (clockX <= CLOCKX_MAX) sim.clockNs[clockX] += t - sim.now;
+    }
+    if (audioFill > frames) {
+        audioFill -= frames;
+    } else if (audioFill > 0) {
+        audioFill = 0;
+        if (audioPlaying && audioPrimed && !player.pauseOn && !cs.cancel &&
+            !poweringOff) {
+            if (ActionFault()) sim.faultUnderruns++;
+            else sim.underruns++;
+        }
+    }
+}
+
+static void SpiCheck(void);
+
+/* Advance the clock by ns, running the Timer1 interrupt, Timer0's
+   uiTrigger and the script on the way. */
+static void HostSpend(u_int64 ns) {
+    u_int64 end = sim.now + ns;
+
+    for (;;) {
+        u_int64 next = end;
+        int timer = (regs[TIMER_ENABLE] & 2) != 0;
+
+        if (timer && nextTick == 0) nextTick = sim.now + TickNs();
+        if (timer && nextTick < next) next = nextTick;
+        if (nextUi < next) next = nextUi;
+        if (!inScript && scriptWake < next) next = scriptWake;
+        if (next > sim.now) {
+            AudioDrain(next);
+            sim.now = next;
+        }
+        SpiCheck();
+        if (sim.now >= nextUi) {
+            uiTrigger = 1;
+            nextUi += UI_TRIGGER_MS * NS_PER_MS;
+        }
+        if (timer && sim.now >= nextTick) {
+            tickPending = 1;
+            nextTick += TickNs();
+        }
+        if (tickPending && !inIsr && (regs[INT_ENABLEL] & INTF_TIM1)) {
+            tickPending = 0;
+            inIsr = 1;
+            InterruptHandler_Timer1();
+            HostSpend(ISR_CYCLES * 1000000000ULL / CpuHz());
+            inIsr = 0;
+        }
+        if (!inScript && sim.now >= scriptWake) {
+            inScript = 1;
+            ScriptRun();
+            inScript = 0;
+        }
+        if (sim.now >= end) break;
+    }
+}
+
+static void HostCycles(u_int32 cycles) {
+    HostSpend((u_int64)cycles * 1000000000ULL / CpuHz());
+}
+
+u_int32 ReadTimeCount(void) {
+    HostCycles(CALL_CYCLES);
+    return (u_int32)(sim.now / NS_PER_MS);
+}
+
+void BusyWait10(void) {
+    HostSpend(10 * NS_PER_MS);
+}
+
+void SetRate(u_int32 hz) {
+    hwSampleRate = hz;
+    sim.clockSets++;
+    HostCycles(200);
+}
+
+void InitAudio(void) {
+    clockX = 6;
+    HostCycles(1000);
+}
+
+u_int16 AudioBufFill(void) {
+    HostCycles(CALL_CYCLES);
+    return (u_int16)audioFill;
+}
+
+void PowerSetVoltages(u_int16 *v) {
+    HostCycles(CALL_CYCLES);
+}
+
+void PlayerVolume(void) {
+    HostCycles(CALL_CYCLES);
+}
+
+void SetInterruptVector_Timer1(void) {
+}
+
+void PatchMSCPacketFromPC(void) {
+}
+
+s_int16 FsMapFlNullOk(struct FsMapper *m) {
+    return 0;
+}
+
+/* ---- Registers ---- */
+
+u_int16 *HostPerip(u_int16 reg) {
+    if (reg >= HOST_REGISTERS) {
+        fprintf(stderr, "hostsim: register %u\n", reg);
+        exit(2);
+    }
+    switch (reg) {
+    case GPIO0_IDATA:
+        regs[reg] = (keysDown & 0x7f) | KEY_8;
+        break;
+    case SCI_STATUS:
+        regs[reg] = (batteryLow ? SCISTF_REGU_POWERLOW : 0) |
+            ((keysDown & KEY_POWER) ? SCISTF_REGU_POWERBUT : 0);
+        break;
+    case SPI0_CONFIG:
+        /* before the write: a chip select going high ends a command */
+        SpiCheck();
+        break;
+    case GPIO0_SET_MASK:
+        regs[GPIO0_ODATA] |= regs[reg];
+        break;
+    case GPIO0_CLEAR_MASK:
+        regs[GPIO0_ODATA] &= ~regs[reg];
+        break;
+    }
+    return &regs[reg];
+}
+
+/* ---- EEPROM: 25xx640 on SPI0 ---- */
+
+#define EE_SIZE         8192
+#define EE_PAGE         32
+static struct {
+    unsigned char mem[EE_SIZE];
+    u_int32 cycles[EE_SIZE / EE_PAGE];
+    u_int16 wel;            /* write enable latch */
+    u_int64 busyUntil;
+    u_int16 active;         /* chip selected */
+    u_int16 cmd, n, addr;
+    unsigned char latch[EE_PAGE];
+    u_int16 latched;
+} ee;
+
+static void SpiCheck(void) {
+    if (!ee.active || !(regs[SPI0_CONFIG] & SPI_CF_FSIDLE1)) return;
+    ee.active = 0;
+    if (ee.cmd == 0x06) {
+        ee.wel = 1;
+    } else if (ee.cmd == 0x04) {
+        ee.wel = 0;
+    } else if (ee.cmd == 0x02 && ee.wel && ee.latched) {
+        u_int16 base = ee.addr & ~(EE_PAGE - 1) & (EE_SIZE - 1), i;
+        for (i = 0; i < EE_PAGE; i++) {
+            if (ee.latched & (1u << (i / 2))) ee.mem[base + i] = ee.latch[i];
+        }
+        ee.cycles[base / EE_PAGE]++;
+        sim.c.eeWrites++;
+        ee.busyUntil = sim.now + EE_WRITE_NS;
+        ee.wel = 0;
+    }
+}
+
+static u_int16 EeByte(u_int16 b) {
+    u_int16 out = 0xff;
+    int busy = sim.now < ee.busyUntil;
+
+    if (!ee.active) {
+        ee.active = 1;
+        ee.n = 0;
+        ee.latched = 0;
+    }
+    if (ee.n == 0) {
+        ee.cmd = (busy && b != 0x05) ? 0 : b;
+    } else if (ee.cmd == 0x05) {
+        out = (busy ? 1 : 0) | (ee.wel ? 2 : 0);
+    } else if ((ee.cmd == 0x03 || ee.cmd == 0x02) && ee.n <= 2) {
+        ee.addr = (ee.addr << 8) | b;
+    } else if (ee.cmd == 0x03) {
+        out = ee.mem[ee.addr++ & (EE_SIZE - 1)];
+    } else if (ee.cmd == 0x02) {
+        u_int16 i = ee.addr & (EE_PAGE - 1);
+        ee.latch[i] = (unsigned char)b;
+        ee.latched |= 1u << (i / 2);
+        ee.addr = (ee.addr & ~(EE_PAGE - 1)) | ((ee.addr + 1) & (EE_PAGE - 1));
+    }
+    ee.n++;
+    return out;
+}
+
+u_int16 SpiSendReceive(u_int16 data) {
+    u_int16 bits = (regs[SPI0_CONFIG] & 0xf) + 1;
+
+    HostCycles(CALL_CYCLES + bits * EE_BIT_CYCLES);
+    if (regs[SPI0_CONFIG] & SPI_CF_FSIDLE1) return 0xffff;
+    if (bits == 16) {
+        u_int16 hi = EeByte(data >> 8);
+        return (hi << 8) | EeByte(data & 0xff);
+    }
+    return EeByte(data & 0xff);
+}
+
+void SpiDelay(u_int16 n) {
+    HostCycles(CALL_CYCLES + n);
+}
+
+/* ---- SD card in SPI mode ---- */
+
+static unsigned char *img;          /* the card, 512-byte sectors */
+static u_int32 imgSectors;
+
+enum cardOut { coNone, coBytes, coToken, coData, coBusy };
+static struct {
+    u_int16 answering;
+    u_int64 backAt;         /* removed until */
+    u_int16 idle, ready, app;
+    u_int16 acmdStarted;
+    u_int64 acmdStart;
+    enum cardOut out;
+    u_int64 readyAt;        /* token or end of busy */
+    u_int16 multi;          /* READ_MULTIPLE_BLOCK */
+    u_int16 reg;            /* sending CID/CSD from bytes[] */
+    u_int32 lba;
+    u_int16 pos;
+    unsigned char bytes[20];
+    u_int16 nbytes;
+    u_int16 errorTokens;    /* glitch: next tokens are errors */
+} card;
+
+static void CardRegister(const unsigned char *r) {
+    memcpy(card.bytes, r, 16);
+    card.bytes[16] = card.bytes[17] = 0;    /* CRC16 */
+    card.nbytes = 18;
+    card.reg = 1;
+    card.multi = 0;
+    card.out = coToken;
+    card.readyAt = sim.now + CARD_REG_NS;
+}
+
+static u_int16 CardByte(void) {
+    if (!card.answering) {
+        if (sim.now < card.backAt) {
+            ActionHit(1);
+            return 0xff;
+        }
+        /* back, as after a power glitch */
+        memset(&card, 0, sizeof(card));
+        card.answering = 1;
+    }
+    switch (card.out) {
+    case coBytes:
+        if (card.pos < card.nbytes) return card.bytes[card.pos++];
+        card.out = coNone;
+        return 0xff;
+    case coToken:
+        if (sim.now < card.readyAt) return 0xff;
+        if (!card.reg && card.errorTokens) {
+            card.errorTokens--;
+            card.out = coNone;
+            ActionHit(1);
+            return 0x04;    /* card ECC failed */
+        }
+        card.out = coData;
+        card.pos = 0;
+        return 0xfe;
+    case coData:
+        if (card.reg) {
+            u_int16 b = card.bytes[card.pos++];
+            if (card.pos == card.nbytes) card.out = coNone;
+            return b;
+        }
+        if (card.pos < 512) {
+            u_int16 b = card.lba < imgSectors ?
+                img[(u_int64)card.lba * 512 + card.pos] : 0;
+            card.pos++;
+            return b;
+        }
+        if (++card.pos == 514) {    /* CRC16 sent */
+            sim.c.sectors++;
+            if (!card.errorTokens) ActionArm(1);
+            if (card.multi) {
+                card.lba++;
+                card.out = coToken;
+                card.readyAt = sim.now + CARD_NEXT_NS;
+            } else {
+                card.out = coNone;
+            }
+        }
+        return 0;
+    case coBusy:
+        if (sim.now < card.readyAt) return 0x00;
+        card.out = coNone;
+        return 0xff;
+    default:
+        return 0xff;
+    }
+}
+
+s_int16 MmcCommand(s_int16 cmd, u_int32 arg) {
+    u_int16 c = cmd & 0x3f, app = card.app, r1;
+    u_int32 blocks = (imgSectors + 1023) & ~1023UL;
+
+    HostCycles(CALL_CYCLES + 8 * 8 * MMC_BIT_CYCLES);
+    sim.c.mmcBytes += 8;
+    sim.c.commands++;
+    CardByte(); /* a removed card comes back here */
+    if (!card.answering) return 0xff;
+    card.app = 0;
+    if (card.out == coData || card.out == coToken) {
+        if (c != MMC_STOP_TRANSMISSION) return 0xff; /* busy sending */
+    }
+    if (c == MMC_GO_IDLE_STATE) {
+        sim.c.cmd0++;
+        memset(&card, 0, sizeof(card));
+        card.answering = 1;
+        card.idle = 1;
+        return 1;
+    }
+    if (!card.idle && !card.ready) {
+        ActionHit(1); /* powered up again, wants CMD0 */
+        return 0xff;
+    }
+    r1 = card.ready ? 0 : 1;
+    switch (c) {
+    case MMC_SEND_IF_COND:
+        card.bytes[0] = 0; card.bytes[1] = 0;
+        card.bytes[2] = (arg >> 8) & 0x0f; card.bytes[3] = arg & 0xff;
+        card.nbytes = 4; card.pos = 0; card.out = coBytes;
+        return r1;
+    case MMC_READ_OCR:
+        card.bytes[0] = card.ready ? 0xc0 : 0x40; /* powered up, SDHC */
+        card.bytes[1] = 0xff; card.bytes[2] = 0x80; card.bytes[3] = 0;
+        card.nbytes = 4; card.pos = 0; card.out = coBytes;
+        return r1;
+    case 55:
+        card.app = 1;
+        return r1;
+    case 41:
+        if (!app) return r1 | 4;
+        if (!card.acmdStarted) {
+            card.acmdStarted = 1;
+            card.acmdStart = sim.now;
+        }
+        if (sim.now - card.acmdStart >= CARD_READY_MS * NS_PER_MS) {
+            card.ready = 1;
+            card.idle = 0;
+            return 0;
+        }
+        return 1;
+    case MMC_SEND_CSD: {
+        u_int32 cSize = blocks / 1024 - 1;
+        unsigned char csd[16] = {0x40, 0x0e, 0x00, 0x32, 0x5b, 0x59, 0x00,
+                                 0, 0, 0, 0x7f, 0x80, 0x0a, 0x40, 0x00, 0x01};
+        csd[7] = (cSize >> 16) & 0x3f; csd[8] = cSize >> 8; csd[9] = cSize;
+        if (!card.ready) return r1 | 4;
+        CardRegister(csd);
+        return 0;
+    }
+    case MMC_SEND_CID: {
+        unsigned char cid[16] = {0x03, 'S', 'D', 'S', 'U', '0', '4', 'G',
+                                 0x80, 0, 0, 0, 0, 0x01, 0x4a, 0x01};
+        cid[9] = opt.serial >> 24; cid[10] = opt.serial >> 16;
+        cid[11] = opt.serial >> 8; cid[12] = opt.serial;
+        if (!card.ready) return r1 | 4;
+        CardRegister(cid);
+        return 0;
+    }
+    case MMC_SET_BLOCKLEN:
+        return r1;
+    case MMC_READ_SINGLE_BLOCK:
+    case MMC_READ_MULTIPLE_BLOCK:
+        if (!card.ready) return r1 | 4;
+        card.lba = arg;
+        card.reg = 0;
+        card.multi = c == MMC_READ_MULTIPLE_BLOCK;
+        card.out = coToken;
+        card.readyAt = sim.now + opt.accessNs;
+        return 0;
+    case MMC_STOP_TRANSMISSION:
+        card.multi = 0;
+        card.out = coBusy;
+        card.readyAt = sim.now + CARD_BUSY_NS;
+        return r1;
+    }
+    return r1 | 4; /* illegal command */
+}
+
+u_int16 SpiSendReceiveMmc(u_int16 dataTopAligned, s_int16 bits) {
+    HostCycles(CALL_CYCLES + bits * MMC_BIT_CYCLES);
+    sim.c.mmcBytes += bits / 8;
+    if (bits == 16) {
+        u_int16 hi = CardByte();
+        return (hi << 8) | CardByte();
+    }
+    return CardByte();
+}
+
+void SpiSendClocks(void) {
+    HostCycles(CALL_CYCLES + 8 * MMC_BIT_CYCLES);
+    sim.c.mmcBytes++;
+    CardByte();
+}
+
+/* ---- Card image ---- */
+
+static void Put16(unsigned char *p, u_int32 v) {
+    p[0] = v; p[1] = v >> 8;
+}
+
+static void Put32(unsigned char *p, u_int32 v) {
+    Put16(p, v); Put16(p + 2, v >> 16);
+}
+
+static u_int32 Get16(const unsigned char *p) {
+    return p[0] | (p[1] << 8);
+}
+
+static u_int32 Get32(const unsigned char *p) {
+    return Get16(p) | (Get16(p + 2) << 16);
+}
+
+static u_int32 OggCrc(const unsigned char *p, u_int32 n) {
+    static u_int32 table[256];
+    u_int32 crc = 0, i;
+
+    if (!table[1]) {
+        for (i = 0; i < 256; i++) {
+            u_int32 r = i << 24, j;
+            for (j = 0; j < 8; j++) r = (r & 0x80000000UL) ? (r << 1) ^ 0x04c11db7UL : r << 1;
+            table[i] = r;
+        }
+    }
+    for (i = 0; i < n; i++) crc = (crc << 8) ^ table[((crc >> 24) ^ p[i]) & 0xff];
+    return crc;
+}
+
+static u_int32 rng = 12345;
+static u_int32 Random(void) {
+    rng ^= rng << 13; rng ^= rng >> 17; rng ^= rng << 5;
+    return rng;
+}
+
+/* One Ogg page of packets of the given sizes at p; returns its length. */
+static u_int32 OggPage(unsigned char *p, u_int16 type, u_int32 granule,
+                       u_int32 serial, u_int32 seq, const u_int32 *packets,
+                       u_int16 count, const unsigned char *data) {
+    u_int16 nseg = 0, i;
+    u_int32 body = 0, len;
+
+    memcpy(p, "OggS", 4);
+    p[4] = 0;
+    p[5] = type;
+    Put32(p + 6, granule);
+    Put32(p + 10, granule == NONE ? NONE : 0);
+    Put32(p + 14, serial);
+    Put32(p + 18, seq);
+    Put32(p + 22, 0);
+    for (i = 0; i < count; i++) {
+        u_int32 n = packets[i];
+        for (; n >= 255; n -= 255) p[27 + nseg++] = 255;
+        p[27 + nseg++] = n;
+        body += packets[i];
+    }
+    p[26] = nseg;
+    len = 27 + nseg + body;
+    memcpy(p + 27 + nseg, data, body);
+    Put32(p + 22, OggCrc(p, len));
+    return len;
+}
+
+struct CHAPTER {
+    u_int32 size;
+    u_int32 pages;
+    u_int32 *offset;        /* byte offset of each page */
+    u_int32 *startGranule;  /* granule at which its audio starts */
+    u_int16 audioPage;      /* first audio page */
+    unsigned char *data;
+};
+
+/* A mono Vorbis-like stream of seconds at opt.bitrate and opt.rate:
+   identification header, a page of comment and setup headers, then
+   ~4 KB audio pages of random packets. */
+static void MakeChapter(struct CHAPTER *ch, u_int32 serial) {
+    u_int32 audioBytes = (u_int32)((u_int64)opt.seconds * opt.bitrate / 8);
+    u_int32 max = audioBytes + audioBytes / 64 + 8192, pos = 0, seq = 0;
+    u_int32 samples = 0, total = opt.seconds * opt.rate;
+    unsigned char body[8192];
+    u_int32 packets[32], i;
+
+    ch->data = malloc(max);
+    ch->offset = malloc((max / 1024 + 8) * sizeof(u_int32));
+    ch->startGranule = malloc((max / 1024 + 8) * sizeof(u_int32));
+    ch->pages = 0;
+    memset(body, 0, 30);
+    memcpy(body, "\001vorbis", 7);
+    body[11] = 1;
+    Put32(body + 12, opt.rate);
+    Put32(body + 20, opt.bitrate);
+    body[28] = 0xb8;
+    body[29] = 1;
+    packets[0] = 30;
+    ch->offset[ch->pages] = pos;
+    ch->startGranule[ch->pages++] = 0;
+    pos += OggPage(ch->data + pos, 2, 0, serial, seq++, packets, 1, body);
+    for (i = 0; i < sizeof(body); i++) body[i] = Random();
+    memcpy(body, "\003vorbis", 7);
+    memcpy(body + 40, "\005vorbis", 7);
+    packets[0] = 40;
+    packets[1] = 3000;
+    ch->offset[ch->pages] = pos;
+    ch->startGranule[ch->pages++] = 0;
+    pos += OggPage(ch->data + pos, 0, 0, serial, seq++, packets, 2, body);
+    ch->audioPage = ch->pages;
+    while (samples < total) {
+        u_int32 bytes = 0, n = 0, s;
+        while (bytes < 4000 && n < 31) {
+            packets[n] = 60 + Random() % 120;
+            bytes += packets[n++];
+        }
+        for (i = 0; i < bytes; i++) body[i] = Random();
+        if (opt.falseCapture && ch->pages % 8 == 5) {
+            /* "OggS", version 0 and a plausible granule, no page */
+            memcpy(body + bytes / 2, "OggS\0\0", 6);
+            Put32(body + bytes / 2 + 6, samples + 1000);
+        }
+        s = (u_int32)((u_int64)bytes * 8 * opt.rate / opt.bitrate);
+        if (samples + s > total) s = total - samples;
+        ch->offset[ch->pages] = pos;
+        ch->startGranule[ch->pages++] = samples;
+        samples += s;
+        pos += OggPage(ch->data + pos, samples >= total ? 4 : 0, samples,
+                       serial, seq++, packets, n, body);
+    }
+    ch->size = pos;
+}
+
+/* SEEK.IDX as seekidx writes it, interval 30 s. */
+static u_int32 MakeSeekIdx(unsigned char *p, struct CHAPTER *ch, u_int16 files) {
+    u_int32 interval = 30, w = 0, f, e = 0, entrySector;
+    u_int32 *dir = malloc((files + 1) * sizeof(u_int32));
+    u_int32 words;
+
+#define PUTW(v) (p[2 * w] = (unsigned char)((v) >> 8), \
+                 p[2 * w + 1] = (unsigned char)(v), w++)
+    entrySector = (8 + 2 * (files + 1) + 255) / 256;
+    for (f = 0; f < files; f++) {
+        u_int32 step = opt.rate * interval, next = 0, k;
+        dir[f] = e;
+        for (k = ch[f].audioPage; k < ch[f].pages; k++) {
+            u_int32 end = k + 1 < ch[f].pages ? ch[f].startGranule[k + 1] :
+                (u_int32)opt.seconds * opt.rate;
+            while (next < end || (k + 1 == ch[f].pages && next <= end)) {
+                e++;
+                next += step;
+            }
+        }
+    }
+    dir[files] = e;
+    PUTW(0x534b); PUTW(0x4958); PUTW(1); PUTW(interval);
+    PUTW(files); PUTW(entrySector); PUTW(0); PUTW(0);
+    for (f = 0; f <= files; f++) { PUTW(dir[f] >> 16); PUTW(dir[f] & 0xffff); }
+    while (w < entrySector * 256) PUTW(0);
+    for (f = 0; f < files; f++) {
+        u_int32 step = opt.rate * interval, next = 0, k;
+        for (k = ch[f].audioPage; k < ch[f].pages; k++) {
+            u_int32 end = k + 1 < ch[f].pages ? ch[f].startGranule[k + 1] :
+                (u_int32)opt.seconds * opt.rate;
+            while (next < end || (k + 1 == ch[f].pages && next <= end)) {
+                PUTW(ch[f].offset[k] >> 16); PUTW(ch[f].offset[k] & 0xffff);
+                PUTW(ch[f].startGranule[k] >> 16); PUTW(ch[f].startGranule[k] & 0xffff);
+                next += step;
+            }
+        }
+    }
+#undef PUTW
+    words = w;
+    free(dir);
+    return words * 2;
+}
+
+/* MENU.MNU: root, two testaments, books of four chapters, chapters,
+   then an end entry; big-endian word pairs (parent, subtree). */
+static u_int32 MakeMenu(unsigned char *p, u_int16 files) {
+    u_int16 books = (files + 3) / 4, testaments = books > 1 ? 2 : 1;
+    u_int16 book1 = 1 + testaments, offset = book1 + books, e = 0, i;
+
+#define ENTRY(a, b) (p[4 * e] = (a) >> 8, p[4 * e + 1] = (a), \
+                     p[4 * e + 2] = (b) >> 8, p[4 * e + 3] = (b), e++)
+    ENTRY(0, book1);
+    for (i = 0; i < testaments; i++) ENTRY(0, book1 + i * ((books + 1) / 2));
+    for (i = 0; i < books; i++) ENTRY(1 + i / ((books + 1) / 2), offset + 4 * i);
+    for (i = 0; i < files; i++) ENTRY(book1 + i / 4, 0);
+    ENTRY(0, 0);
+#undef ENTRY
+    return 4 * e;
+}
+
+/* FAT32 volume in an MBR partition: MENU.MNU, optionally SEEK.IDX,
+   then CH0001.OGG... in the root directory, with -d the later chapters
+   in BOOK, 32 KB clusters. */
+static void MakeCard(void) {
+    const u_int32 part = 64, reserved = 32, spc = 64;
+    struct CHAPTER *ch = calloc(opt.files, sizeof(*ch));
+    unsigned char *menu = calloc(1, 4 * (opt.files * 2 + 16));
+    unsigned char *idx = NULL;
+    u_int32 menuSize, idxSize = 0, dataBytes = 0, clusters, fatSectors;
+    u_int32 files = opt.files + 1 + (opt.seekIdx ? 1 : 0), f, cl = 3;
+    u_int32 fat, data, total, slot = 0, freed = 0;
+    unsigned char *boot, *dir;
+
+    for (f = 0; f < opt.files; f++) {
+        MakeChapter(&ch[f], f + 1);
+        dataBytes += ch[f].size + spc * 512 * 2;
+    }
+    menuSize = MakeMenu(menu, opt.files);
+    if (opt.seekIdx) {
+        idx = calloc(1, 512 * (2 + opt.files * (opt.seconds / 30 + 2) * 8 / 512 + 2));
+        idxSize = MakeSeekIdx(idx, ch, opt.files);
+    }
+    clusters = dataBytes / (spc * 512) + 16 + files;
+    fatSectors = (clusters + 2) * 4 / 512 + 1;
+    fat = part + reserved;
+    data = fat + 2 * fatSectors;
+    total = data + clusters * spc;
+    imgSectors = total + part;
+    img = calloc(imgSectors, 512);
+    if (!img) {
+        fputs("hostsim: out of memory\n", stderr);
+        exit(2);
+    }
+    /* MBR */
+    img[0x1be + 4] = 0x0c;
+    Put32(img + 0x1c6, part);
+    Put32(img + 0x1ca, total);
+    img[510] = 0x55; img[511] = 0xaa;
+    /* boot sector */
+    boot = img + part * 512;
+    boot[0] = 0xeb; boot[1] = 0x58; boot[2] = 0x90;
+    memcpy(boot + 3, "HOSTSIM ", 8);
+    Put16(boot + 11, 512);
+    boot[13] = spc;
+    Put16(boot + 14, reserved);
+    boot[16] = 2;
+    boot[21] = 0xf8;
+    Put32(boot + 28, part);
+    Put32(boot + 32, total);
+    Put32(boot + 36, fatSectors);
+    Put32(boot + 44, 2);
+    Put16(boot + 48, 1);
+    Put16(boot + 50, 6);
+    boot[64] = 0x80;
+    boot[66] = 0x29;
+    Put32(boot + 67, 0x0512abcd);
+    memcpy(boot + 71, "OSAB       FAT32   ", 19);
+    boot[510] = 0x55; boot[511] = 0xaa;
+    /* FAT */
+#define SETFAT(c, v) (Put32(img + fat * 512 + 4 * (c), (v)), \
+                      Put32(img + (fat + fatSectors) * 512 + 4 * (c), (v)))
+    SETFAT(0, 0x0ffffff8UL);
+    SETFAT(1, 0x0fffffffUL);
+    SETFAT(2, 0x0fffffffUL);    /* root directory: one cluster */
+    dir = img + (u_int64)data * 512;
+    for (f = 0; f < files; f++) {
+        unsigned char *e;
+        const unsigned char *src;
+        u_int32 size, n, i, first, split = 0;
+        if (opt.subdir && f == opt.subdir + (opt.seekIdx ? 1 : 0)) {
+            /* BOOK, the last root entry, one cluster */
+            e = dir + 32 * slot;
+            memcpy(e, "BOOK       ", 11);
+            e[11] = 0x10;
+            Put16(e + 20, cl >> 16);
+            Put16(e + 26, cl & 0xffff);
+            SETFAT(cl, 0x0fffffffUL);
+            dir = img + ((u_int64)data + (cl - 2) * spc) * 512;
+            memcpy(dir, ".          ", 11);
+            dir[11] = 0x10;
+            Put16(dir + 20, cl >> 16);
+            Put16(dir + 26, cl & 0xffff);
+            memcpy(dir + 32, "..         ", 11);
+            dir[32 + 11] = 0x10;
+            slot = 2;
+            cl++;
+        }
+        e = dir + 32 * slot++;
+        first = cl;
+        if (f == 0) {
+            memcpy(e, "MENU    MNU", 11);
+            src = menu; size = menuSize;
+        } else if (opt.seekIdx && f == 1) {
+            memcpy(e, "SEEK    IDX", 11);
+            src = idx; size = idxSize;
+        } else {
+            u_int32 c = f - 1 - (opt.seekIdx ? 1 : 0);
+            sprintf((char *)e, "CH%04u  OGG", c + 1);
+            src = ch[c].data; size = ch[c].size;
+            if (opt.fragEvery && c % opt.fragEvery == opt.fragEvery - 1) split = 1;
+        }
+        e[11] = 0x20;
+        n = (size + spc * 512 - 1) / (spc * 512);
+        if (n == 0) n = 1;
+        for (i = 0; i < n; i++) {
+            u_int32 next = cl + 1;
+            if (split && i == n / 2 - 1) next = cl + 2; /* skip one cluster */
+            memcpy(img + ((u_int64)data + (cl - 2) * spc) * 512,
+                   src + (u_int64)i * spc * 512,
+                   size - i * spc * 512 < spc * 512 ? size - i * spc * 512 : spc * 512);
+            SETFAT(cl, i + 1 == n ? 0x0fffffffUL : next);
+            cl = next;
+        }
+        Put16(e + 20, first >> 16);
+        Put16(e + 26, first & 0xffff);
+        Put32(e + 28, size);
+        if (opt.unlink && f == files - 1) {
+            e[0] = 0xe5;
+            for (i = first; i < cl; i++) SETFAT(i, 0);
+            freed = n;
+        }
+    }
+    sim.cardFiles = opt.files - opt.unlink;
+#undef SETFAT
+    /* FSInfo */
+    boot = img + (part + 1) * 512;
+    Put32(boot, 0x41615252UL);
+    Put32(boot + 484, 0x61417272UL);
+    Put32(boot + 488, clusters + 2 - cl + freed);
+    Put32(boot + 492, cl);
+    Put32(boot + 508, 0xaa550000UL);
+    for (f = 0; f < opt.files; f++) {
+        free(ch[f].data); free(ch[f].offset); free(ch[f].startGranule);
+    }
+    free(ch); free(menu); free(idx);
+}
+
+static void LoadFile(const char *name, unsigned char **buf, u_int32 *size) {
+    FILE *fp = fopen(name, "rb");
+    long n;
+
+    if (!fp) {
+        perror(name);
+        exit(2);
+    }
+    fseek(fp, 0, SEEK_END);
+    n = ftell(fp);
+    rewind(fp);
+    if (!*buf) *buf = calloc(1, n + 512);
+    if (!*buf || fread(*buf, 1, n, fp) != (size_t)n) {
+        fprintf(stderr, "hostsim: cannot read %s\n", name);
+        exit(2);
+    }
+    fclose(fp);
+    *size = n;
+}
+
+static void SaveFile(const char *name, const unsigned char *buf, u_int32 size) {
+    FILE *fp = fopen(name, "wb");
+
+    if (!fp || fwrite(buf, 1, size, fp) != size || fclose(fp)) {
+        perror(name);
+        exit(2);
+    }
+}
+
+/* ---- Minifat ---- */
+
+static u_int16 MfByte(const u_int16 *p, u_int16 i) {
+    return (i & 1) ? p[i >> 1] & 0xff : p[i >> 1] >> 8;
+}
+
+static u_int32 MfLong(const u_int16 *p, u_int16 i) {
+    return MfByte(p, i) | (MfByte(p, i + 1) << 8) |
+        ((u_int32)(MfByte(p, i + 2) | (MfByte(p, i + 3) << 8)) << 16);
+}
+
+/* Sector lba in minifatBuffer, read through the mapper unless it is
+   the one held there already. */
+static const u_int16 *MfSector(u_int32 lba) {
+    HostCycles(CALL_CYCLES);
+    if (minifatInfo.currentSector != lba) {
+        if (lba - minifatInfo.fatStart < (u_int32)minifatInfo.dataStart - minifatInfo.fatStart &&
+            minifatInfo.rootCluster) {
+            sim.c.fatSectors++;
+        }
+        minifatInfo.currentSector = NONE;
+        if (map->Read(map, lba, 1, minifatBuffer) != 1) return NULL;
+        minifatInfo.currentSector = lba;
+    }
+    return minifatBuffer;
+}
+
+static u_int32 MfNext(u_int32 cluster) {
+    u_int32 off = cluster * (minifatInfo.fatBits / 8);
+    const u_int16 *p = MfSector(minifatInfo.fatStart + off / 512);
+
+    if (!p) return 0;
+    if (minifatInfo.fatBits == 16) {
+        u_int32 v = MfByte(p, off & 511) | (MfByte(p, (off & 511) + 1) << 8);
+        return v >= 0xfff8 ? NONE : v;
+    } else {
+        u_int32 v = MfLong(p, off & 511) & 0x0fffffffUL;
+        return v >= 0x0ffffff8UL ? NONE : v;
+    }
+}
+
+static u_int32 MfLba(u_int32 cluster) {
+    return minifatInfo.dataStart + (cluster - 2) * minifatInfo.clusterSectors;
+}
+
+/* List the fragments of the chain from cluster on. */
+static void MfFragments(u_int32 cluster) {
+    u_int16 n = 0;
+
+    memset(minifatFragments, 0, sizeof(minifatFragments));
+    minifatInfo.nextCluster = 0;
+    while (cluster != NONE && cluster >= 2) {
+        u_int32 next;
+        if (n == MAX_FRAGMENTS) {
+            minifatInfo.nextCluster = cluster;
+            return;
+        }
+        minifatFragments[n].start = MfLba(cluster);
+        minifatFragments[n].size = minifatInfo.clusterSectors;
+        while ((next = MfNext(cluster)) == cluster + 1) {
+            minifatFragments[n].size += minifatInfo.clusterSectors;
+            cluster = next;
+        }
+        cluster = next;
+        n++;
+    }
+    if (n) minifatFragments[n - 1].start |= FRAG_LAST;
+}
+
+s_int16 InitFileSystem(void) {
+    const u_int16 *p;
+    u_int32 boot = 0, fatSize, reserved;
+
+    sim.c.fsInits++;
+    HostCycles(500);
+    memset(&minifatInfo, 0, sizeof(minifatInfo));
+    minifatInfo.currentSector = NONE;
+    minifatInfo.lastFile = 0xffff;
+    if (!(p = MfSector(0))) return -1;
+    if (MfByte(p, 11) != 0x00 || MfByte(p, 12) != 0x02) {
+        boot = MfLong(p, 0x1c6);
+        if (!(p = MfSector(boot))) return -1;
+    }
+    if (MfByte(p, 510) != 0x55 || MfByte(p, 511) != 0xaa) return -1;
+    reserved = MfByte(p, 14) | (MfByte(p, 15) << 8);
+    fatSize = MfByte(p, 22) | (MfByte(p, 23) << 8);
+    minifatInfo.clusterSectors = MfByte(p, 13);
+    minifatInfo.fatStart = boot + reserved;
+    if (fatSize) {
+        u_int16 rootEntries = MfByte(p, 17) | (MfByte(p, 18) << 8);
+        minifatInfo.fatBits = 16;
+        minifatInfo.rootStart = minifatInfo.fatStart + MfByte(p, 16) * fatSize;
+        minifatInfo.rootSectors = (rootEntries * 32 + 511) / 512;
+        minifatInfo.dataStart = minifatInfo.rootStart + minifatInfo.rootSectors;
+    } else {
+        fatSize = MfLong(p, 36);
+        minifatInfo.fatBits = 32;
+        minifatInfo.rootCluster = MfLong(p, 44);
+        minifatInfo.dataStart = minifatInfo.fatStart + MfByte(p, 16) * fatSize;
+    }
+    return 0;
+}
+
+/* Where MfFind() found its entry. */
+static u_int32 mfLba;
+static u_int16 mfOffset;
+
+/* Walk the directory at cluster (0: the FAT16 root) and, depth first,
+   its subdirectories, numbering the entries in *e, for the n'th file
+   with a supported suffix from entry `from' on, or for base name if
+   given.  Returns 1 when found, 0 at the end of the directory, -1 on
+   a read error. */
+static int MfWalk(u_int32 cluster, u_int16 n, const char *base, u_int32 from,
+                  u_int32 *e, u_int16 *count, u_int16 depth) {
+    while (1) {
+        u_int16 sectors = cluster ? minifatInfo.clusterSectors : minifatInfo.rootSectors, s;
+        for (s = 0; s < sectors; s++) {
+            u_int32 lba = (cluster ? MfLba(cluster) : minifatInfo.rootStart) + s;
+            const u_int16 *p = MfSector(lba);
+            u_int16 i;
+            if (!p) return -1;
+            for (i = 0; i < 512; i += 32, ++*e) {
+                u_int32 id, k;
+                const u_int32 *suffix;
+                if (MfByte(p, i) == 0) return 0;
+                if (MfByte(p, i) == 0xe5) continue;
+                if ((MfByte(p, i + 11) & 0x1e) == 0x10 && MfByte(p, i) != '.' && depth < 8) {
+                    u_int32 sub = ((u_int32)(MfByte(p, i + 20) | (MfByte(p, i + 21) << 8)) << 16) |
+                        MfByte(p, i + 26) | (MfByte(p, i + 27) << 8);
+                    int r = MfWalk(sub, n, base, from, e, count, depth + 1);
+                    if (r) return r;
+                    if (!(p = MfSector(lba))) return -1;
+                    continue;
+                }
+                if (*e < from || (MfByte(p, i + 11) & 0x1e)) continue;
+                id = ((u_int32)MfByte(p, i + 8) << 16) | (MfByte(p, i + 9) << 8) | MfByte(p, i + 10);
+                for (suffix = minifatInfo.supportedSuffixes; suffix && *suffix; suffix++) {
+                    if (*suffix == id) break;
+                }
+                if (!suffix || !*suffix) continue;
+                if (base) {
+                    for (k = 0; k < 8 && MfByte(p, i + k) == (unsigned char)base[k]; k++)
+                        ;
+                    if (k < 8) continue;
+                } else if ((*count)++ != n) {
+                    continue;
+                }
+                mfLba = lba;
+                mfOffset = i;
+                return 1;
+            }
+        }
+        if (!cluster || (cluster = MfNext(cluster)) == NONE) return 0;
+    }
+}
+
+/* The entry number of the n'th file from entry `from' (file number
+   `*count') on, or of base name if given; NONE if not found, with
+   *count set to the files seen.  Like the ROM, reads the directories
+   from the start even when going on from a later entry. */
+static u_int32 MfFind(u_int16 n, const char *base, u_int32 from, u_int16 *count) {
+    u_int32 e = 0;
+
+    return MfWalk(minifatInfo.rootCluster, n, base, from, &e, count, 0) > 0 ? e : NONE;
+}
+
+static void MfOpen(void) {
+    const u_int16 *p = MfSector(mfLba);
+    u_int16 i = mfOffset;
+
+    if (!p) return;
+    minifatInfo.fileSize = MfLong(p, i + 28);
+    minifatInfo.fragmentBase = 0;
+    MfFragments(((u_int32)(MfByte(p, i + 20) | (MfByte(p, i + 21) << 8)) << 16) |
+                MfByte(p, i + 26) | (MfByte(p, i + 27) << 8));
+}
+
+/* Open the n'th file, or count the files if there are fewer.  Returns
+   -1 when opened. */
+static s_int16 MfOpenFile(u_int16 n, u_int16 fast) {
+    u_int16 count = 0;
+    u_int32 from = 0, e;
+
+    HostCycles(200);
+    if (fast && minifatInfo.lastFile != 0xffff && n > minifatInfo.lastFile) {
+        count = minifatInfo.lastFile + 1;
+        from = minifatInfo.lastEntry + 1;
+    }
+    e = MfFind(n, NULL, from, &count);
+    if (e == NONE) return count;
+    minifatInfo.lastFile = n;
+    minifatInfo.lastEntry = e;
+    MfOpen();
+    return -1;
+}
+
+static s_int16 (*hookOpenFile)(u_int16 n);
+static s_int16 RealOpenFile(u_int16 n) {
+    return MfOpenFile(n, 0);
+}
+
+s_int16 FatFastOpenFile(u_int16 n) {
+    return MfOpenFile(n, 1);
+}
+
+s_int16 OpenFile(u_int16 n) {
+    return hookOpenFile ? hookOpenFile(n) : RealOpenFile(n);
+}
+
+u_int16 OpenFileBaseName(const char *name) {
+    u_int16 count = 0;
+    u_int32 e;
+
+    HostCycles(200);
+    e = MfFind(0, name + 1, 0, &count); /* name is a Pascal string */
+    if (e == NONE) return 0xffff;
+    minifatInfo.lastFile = 0xffff;
+    MfOpen();
+    return 0;
+}
+
+/* LBA of file sector k, following minifatFragments and the FAT
+   beyond them; NONE past the end. */
+static u_int32 MfFileLba(u_int32 k) {
+    for (;;) {
+        u_int32 base = minifatInfo.fragmentBase;
+        u_int16 i;
+        for (i = 0; i < MAX_FRAGMENTS && minifatFragments[i].size; i++) {
+            if (k < base + minifatFragments[i].size) {
+                return (minifatFragments[i].start & ~FRAG_LAST) + (k - base);
+            }
+            base += minifatFragments[i].size;
+            if (minifatFragments[i].start & FRAG_LAST) return NONE;
+        }
+        if (!minifatInfo.nextCluster) return NONE;
+        MfFragments(minifatInfo.nextCluster);
+        minifatInfo.fragmentBase = base;
+    }
+}
+
+/* ---- Playback ---- */
+
+static struct READER {
+    u_int32 sector;         /* next file sector */
+    u_int32 lba;            /* LBA whose bytes are in minifatBuffer */
+    u_int16 pos;            /* next byte there, 512 for none */
+    u_int16 error;
+    u_int16 wrong;          /* the last byte is not the card's */
+    unsigned char page[65536];
+    unsigned char pageWrong[65536];
+    unsigned char back[65536];  /* bytes to read again after a bad page */
+    unsigned char backWrong[65536];
+    u_int32 backLen, backPos;
+} rd;
+
+static int StreamByte(void) {
+    u_int16 b;
+
+    if (rd.backPos < rd.backLen) {
+        rd.wrong = rd.backWrong[rd.backPos];
+        return rd.back[rd.backPos++];
+    }
+    if (rd.pos == 512) {
+        u_int32 lba;
+        if ((u_int64)rd.sector * 512 >= minifatInfo.fileSize) return -1;
+        lba = MfFileLba(rd.sector++);
+        if (lba == NONE || !MfSector(lba)) {
+            rd.error = 1;
+            return -1;
+        }
+        rd.lba = lba;
+        rd.pos = 0;
+    }
+    if ((u_int64)(rd.sector - 1) * 512 + rd.pos >= minifatInfo.fileSize) return -1;
+    /* the decoder trusts minifatBuffer to still hold rd.lba */
+    b = MfByte(minifatBuffer, rd.pos);
+    if (minifatInfo.currentSector != rd.lba) sim.corrupt++;
+    rd.wrong = b != img[(u_int64)rd.lba * 512 + rd.pos];
+    rd.pos++;
+    return b;
+}
+
+/* Byte n of the page being read is b, just returned by StreamByte(). */
+static void PageByte(u_int32 n, int b) {
+    rd.page[n] = b;
+    rd.pageWrong[n] = rd.wrong;
+}
+
+/* Next page with a good CRC into rd.page; returns its length, 0 at
+   the end of the file. */
+static u_int32 ReadPage(void) {
+    for (;;) {
+        u_int32 n = 0, len, i;
+        int b;
+        /* capture pattern */
+        while (n < 4) {
+            if ((b = StreamByte()) < 0) return 0;
+            if (b == "OggS"[n]) PageByte(n++, b);
+            else n = (b == 'O') ? (PageByte(0, b), 1) : 0;
+        }
+        for (; n < 27; n++) {
+            if ((b = StreamByte()) < 0) return 0;
+            PageByte(n, b);
+        }
+        len = 27 + rd.page[26];
+        for (; n < len; n++) {
+            if ((b = StreamByte()) < 0) return 0;
+            PageByte(n, b);
+        }
+        for (i = 0; i < rd.page[26]; i++) len += rd.page[27 + i];
+        for (; n < len; n++) {
+            if ((b = StreamByte()) < 0) return 0;
+            PageByte(n, b);
+        }
+        HostCycles(len * PAGE_CYCLES);
+        if (rd.page[4] == 0) {
+            u_int32 crc = Get32(rd.page + 22);
+            Put32(rd.page + 22, 0);
+            if (OggCrc(rd.page, len) == crc) {
+                Put32(rd.page + 22, crc);
+                for (i = 0; i < len; i++) sim.corrupt += rd.pageWrong[i];
+                return len;
+            }
+        }
+        /* not a page: search again from after the capture pattern */
+        sim.badPages++;
+        {
+            u_int32 left = rd.backLen - rd.backPos;
+            memmove(rd.back + (len - 4), rd.back + rd.backPos, left);
+            memmove(rd.backWrong + (len - 4), rd.backWrong + rd.backPos, left);
+            memcpy(rd.back, rd.page + 4, len - 4);
+            memcpy(rd.backWrong, rd.pageWrong + 4, len - 4);
+            rd.backLen = len - 4 + left;
+            rd.backPos = 0;
+        }
+    }
+}
+
+s_int16 PlayCurrentFile(void) {
+    u_int32 rate = 0, bitrate = 0, cycles = 0, headers = 0, len;
+    u_int64 last = NONE;
+    u_int32 goTo = cs.goTo == 0xffff ? 0 : cs.goTo;
+    s_int16 ret = ceOk;
+
+    memset(&rd, 0, offsetof(struct READER, page));
+    rd.pos = 512;
+    rd.backLen = rd.backPos = 0;
+    cs.playTimeSeconds = 0;
+    audioPlaying = 1;
+    audioPrimed = 0;
+    sim.files++;
+    ActionArm(0);
+    while ((len = ReadPage()) != 0) {
+        const unsigned char *body = rd.page + 27 + rd.page[26];
+        u_int64 granule = Get32(rd.page + 6) | ((u_int64)Get32(rd.page + 10) << 32);
+        u_int32 samples;
+
+        if (cs.cancel) {
+            ret = ceCancelled;
+            break;
+        }
+        if ((rd.page[5] & 2) && !memcmp(body, "\001vorbis", 7)) {
+            rate = Get32(body + 12);
+            bitrate = Get32(body + 20);
+            cycles = 100 + bitrate / 500;
+            SetRate(rate);
+            headers = 1;
+            continue;
+        }
+        if (granule == 0) {
+            headers++;
+            continue;
+        }
+        if (granule == (u_int64)-1) continue;
+        if (headers < 2) {
+            sim.badFiles++;
+            ret = ceFormatNotFound;
+            break;
+        }
+        /* the first page after a gap only primes the decoder */
+        samples = last == NONE ? 0 : (u_int32)(granule - last);
+        last = granule;
+        if (granule < (u_int64)goTo * rate) {
+            cs.playTimeSeconds = (u_int32)(granule / rate);
+            continue;
+        }
+        cs.goTo = 0xffff;
+        while (samples) {
+            u_int32 n = samples > DECODE_CHUNK ? DECODE_CHUNK : samples;
+            if (player.pauseOn) {
+                while (player.pauseOn && !cs.cancel) {
+                    IdleHook();
+                    HostSpend(NS_PER_MS);
+                }
+                ActionArm(0);
+            }
+            while (audioFill + n > AUDIO_FRAMES && !cs.cancel) {
+                u_int64 ns = (u_int64)((audioFill + n - AUDIO_FRAMES) * 1e9 / rate) + 1;
+                IdleHook();
+                HostSpend(ns < NS_PER_MS ? ns : NS_PER_MS);
+            }
+            if (cs.cancel) break;
+            HostCycles(n * cycles);
+            audioFill += n;
+            if (audioFill >= AUDIO_FRAMES / 2) audioPrimed = 1;
+            ActionAudio();
+            samples -= n;
+            cs.playTimeSamples = (u_int32)(granule - samples);
+            cs.playTimeSeconds = cs.playTimeSamples / rate;
+            LoadCheck(&cs, 0);
+        }
+        if (cs.cancel) {
+            ret = ceCancelled;
+            break;
+        }
+    }
+    if (rd.error && ret == ceOk) ret = ceOtherError;
+    if (!rate && ret == ceOk) ret = ceFormatNotFound;
+    if (ret == ceOk) sim.gapFrom = sim.now + (u_int64)(audioFill * 1e9 / (rate ? rate : 1));
+    audioPlaying = 0;
+    return ret;
+}
+
+/* Lower clockX after LOADCHECK_HIGH calls with a full buffer, raise
+   it as soon as the buffer is a quarter full or less. */
+#define LOADCHECK_HIGH  64
+void RealLoadCheck(struct CodecServices *c, s_int16 n) {
+    static u_int16 high;
+    u_int16 fill;
+
+    if (n > 0) {
+        /* n samples of silence */
+        HostSpend((u_int64)n * 1000000000ULL / hwSampleRate);
+        return;
+    }
+    HostCycles(40);
+    fill = (u_int16)audioFill;
+    if (fill <= AUDIO_FRAMES / 4) {
+        high = 0;
+        if (clockX < CLOCKX_MAX) {
+            clockX++;
+            SetRate(hwSampleRate);
+        }
+    } else if (fill >= AUDIO_FRAMES * 3 / 4) {
+        if (++high >= LOADCHECK_HIGH && clockX > 2) {
+            high = 0;
+            clockX--;
+            SetRate(hwSampleRate);
+        }
+    } else {
+        high = 0;
+    }
+}
+
+/* ---- Hooks and keys ---- */
+
+static void (*hookKey)(enum keyEvent);
+static void (*hookIdle)(void);
+static void (*hookPowerOff)(void);
+static void (*hookLoadCheck)(struct CodecServices *, s_int16);
+
+void HostSetHook(const char *hook, void (*func)(void)) {
+    if (strstr(hook, "KeyEventHandler")) hookKey = (void (*)(enum keyEvent))func;
+    else if (strstr(hook, "IdleHook")) hookIdle = func;
+    else if (strstr(hook, "PowerOff")) hookPowerOff = func;
+    else if (strstr(hook, "LoadCheck")) hookLoadCheck = (void (*)(struct CodecServices *, s_int16))func;
+    else if (strstr(hook, "OpenFile")) hookOpenFile = (s_int16 (*)(u_int16))func;
+}
+
+void KeyEventHandler(enum keyEvent event) {
+    ActionHit(0);
+    if (hookKey) hookKey(event);
+    else RealKeyEventHandler(event);
+}
+
+void IdleHook(void) {
+    sim.idleCalls++;
+    HostCycles(CALL_CYCLES);
+    if (hookIdle) hookIdle();
+}
+
+void PowerOff(void) {
+    poweringOff = 1;
+    if (hookPowerOff) hookPowerOff();
+    else RealPowerOff();
+}
+
+void LoadCheck(struct CodecServices *c, s_int16 n) {
+    if (hookLoadCheck) hookLoadCheck(c, n);
+    else RealLoadCheck(c, n);
+}
+
+void RealKeyEventHandler(enum keyEvent event) {
+    HostCycles(100);
+    switch (event) {
+    case ke_volumeUp2:
+        if (player.volume > -48) player.volume -= 2;
+        break;
+    case ke_volumeDown2:
+        if (player.volume < 200) player.volume += 2;
+        break;
+    case ke_powerOff:
+        PowerOff();
+        break;
+    default:
+        break;
+    }
+}
+
+static void KeyMap(u_int16 code) {
+    const struct KeyMapping *k;
+
+    for (k = currentKeyMap; k && k->key; k++) {
+        if (k->key == code) {
+            KeyEventHandler((enum keyEvent)(k->event & ~KEY_LONG_ONESHOT));
+            return;
+        }
+    }
+}
+
+/* Short press on release, long press after LONG_PRESS_MS, repeated
+   every REPEAT_MS unless the event is KEY_LONG_ONESHOT. */
+void KeyScan9(void) {
+    static u_int16 longDone;
+    static u_int32 repeatAt;
+    u_int16 keys = (PERIP(GPIO0_IDATA) & 0x7f) |
+        ((PERIP(SCI_STATUS) & SCISTF_REGU_POWERBUT) ? KEY_POWER : 0);
+    u_int32 now = ReadTimeCount();
+
+    if (keys) {
+        if (!keyOld) {
+            keyOldTime = (s_int16)now;
+            longDone = 0;
+        }
+        keyOld |= keys;
+        if ((u_int16)(now - keyOldTime) >= LONG_PRESS_MS && now >= repeatAt) {
+            const struct KeyMapping *k;
+            for (k = currentKeyMap; k && k->key; k++) {
+                if (k->key == (KEY_LONG_PRESS | keyOld)) break;
+            }
+            if (k && k->key && !((k->event & KEY_LONG_ONESHOT) && longDone)) {
+                longDone = 1;
+                repeatAt = now + REPEAT_MS;
+                KeyMap(KEY_LONG_PRESS | keyOld);
+            }
+        }
+    } else if (keyOld) {
+        u_int16 old = keyOld;
+        keyOld = 0;
+        if ((u_int16)(now - keyOldTime) < LONG_PRESS_MS && !longDone) {
+            KeyMap(old);
+        } else {
+            KeyMap(KEY_LONG_PRESS | KEY_RELEASED);
+        }
+        repeatAt = 0;
+    }
+}
+
+/* ---- Script and actions ---- */
+
+enum stepKind { stPlay, stKey, stGlitch, stRemove, stBattery };
+struct STEP {
+    enum stepKind kind;
+    char label[32];
+    u_int16 keys;
+    u_int32 arg;
+};
+static struct STEP *steps;
+static u_int16 nSteps, step;
+static u_int64 stepEnd, releaseAt;
+
+struct ACTION {
+    char label[32];
+    struct COUNTERS start;
+    struct COUNTERS cost;
+    u_int16 tier;
+    u_int16 timedOut;
+    u_int16 armed;          /* audio from here on ends it */
+    u_int16 fault;          /* ends after a good read past the fault */
+    u_int16 hit;            /* the key event came, or the firmware ran
+                               into the fault */
+};
+static struct ACTION *actions, *open;
+static u_int16 nActions;
+
+static void ActionStart(const char *label) {
+    if (!strcmp(label, "-")) return;
+    actions = realloc(actions, (nActions + 1) * sizeof(*actions));
+    open = &actions[nActions++];
+    memset(open, 0, sizeof(*open));
+    snprintf(open->label, sizeof(open->label), "%s", label);
+    sim.c.ns = sim.now;
+    open->start = sim.c;
+}
+
+static void ActionEnd(u_int16 timedOut) {
+    struct COUNTERS *s = &open->start, *c = &open->cost;
+
+    sim.c.ns = sim.now;
+    c->ns = sim.c.ns - s->ns;
+    c->sectors = sim.c.sectors - s->sectors;
+    c->commands = sim.c.commands - s->commands;
+    c->fatSectors = sim.c.fatSectors - s->fatSectors;
+    c->eeWrites = sim.c.eeWrites - s->eeWrites;
+    c->mmcBytes = sim.c.mmcBytes - s->mmcBytes;
+    c->cmd0 = sim.c.cmd0 - s->cmd0;
+    c->fsInits = sim.c.fsInits - s->fsInits;
+    open->tier = c->fsInits ? 3 : c->cmd0 ? 2 : 1;
+    open->timedOut = timedOut;
+    open = NULL;
+    scriptWake = sim.now;
+}
+
+static u_int16 ActionFault(void) {
+    return open && open->fault;
+}
+
+/* Playback restarted, or with fault, the card read a sector again. */
+static void ActionArm(u_int16 fault) {
+    if (open && open->fault == fault && open->hit) open->armed = 1;
+}
+
+/* A key action is timed from its key event, a fault from the first
+   access that fails. */
+static void ActionHit(u_int16 fault) {
+    if (open && open->fault == fault && !open->hit) {
+        open->hit = 1;
+        sim.c.ns = sim.now;
+        open->start = sim.c;
+    }
+}
+
+/* Audio came out of PlayCurrentFile(). */
+static void ActionAudio(void) {
+    if (sim.gapFrom) {
+        if (sim.now > sim.gapFrom) {
+            u_int64 gap = sim.now - sim.gapFrom;
+            sim.gapSum += gap;
+            if (gap > sim.gapMax) sim.gapMax = gap;
+        }
+        sim.gaps++;
+        sim.gapFrom = 0;
+    }
+    if (open && open->armed) ActionEnd(0);
+}
+
+static void ScriptRun(void) {
+    if (releaseAt && sim.now >= releaseAt) {
+        keysDown = 0;
+        releaseAt = 0;
+    }
+    if (open) {
+        u_int64 limit = open->start.ns + ACTION_TIMEOUT_MS * NS_PER_MS;
+        if (sim.now < limit) {
+            scriptWake = releaseAt && releaseAt < limit ? releaseAt : limit;
+            return;
+        }
+        ActionEnd(1);
+    }
+    if (releaseAt) {
+        scriptWake = releaseAt;
+        return;
+    }
+    if (sim.now < stepEnd) {
+        scriptWake = stepEnd;
+        return;
+    }
+    if (step == nSteps) {
+        longjmp(simExit, 1);
+    }
+    {
+        struct STEP *s = &steps[step++];
+        switch (s->kind) {
+        case stPlay:
+            stepEnd = sim.now + s->arg * NS_PER_MS;
+            break;
+        case stKey:
+            ActionStart(s->label);
+            keysDown = s->keys;
+            releaseAt = sim.now + s->arg * NS_PER_MS;
+            break;
+        case stGlitch:
+            ActionStart(s->label);
+            if (open) open->fault = 1;
+            card.errorTokens = s->arg;
+            break;
+        case stRemove:
+            ActionStart(s->label);
+            if (open) open->fault = 1;
+            card.answering = 0;
+            card.backAt = sim.now + s->arg * NS_PER_MS;
+            break;
+        case stBattery:
+            batteryLow = s->arg;
+            break;
+        }
+    }
+    scriptWake = sim.now;
+}
+
+static u_int16 ParseKeys(const char *s) {
+    u_int16 keys = 0;
+
+    while (*s) {
+        if (!strncmp(s, "power", 5)) {
+            keys |= KEY_POWER;
+            s += 5;
+        } else if (*s >= '1' && *s <= '7') {
+            keys |= 1 << (*s++ - '1');
+        } else if (*s == '+') {
+            s++;
+        } else {
+            return 0;
+        }
+    }
+    return keys;
+}
+
+static void LoadScript(const char *name) {
+    FILE *fp = fopen(name, "r");
+    char line[256];
+    int n = 0;
+
+    if (!fp) {
+        perror(name);
+        exit(2);
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        char word[32], label[32], keys[32];
+        unsigned long a = 0;
+        struct STEP s;
+        char *hash = strchr(line, '#');
+        n++;
+        if (hash) *hash = 0;
+        if (sscanf(line, "%31s", word) != 1) continue;
+        memset(&s, 0, sizeof(s));
+        if (!strcmp(word, "play") && sscanf(line, "%*s %lu", &a) == 1) {
+            s.kind = stPlay;
+        } else if (!strcmp(word, "key") &&
+                   sscanf(line, "%*s %31s %31s %lu", label, keys, &a) == 3 &&
+                   (s.keys = ParseKeys(keys)) != 0) {
+            s.kind = stKey;
+            strcpy(s.label, label);
+        } else if (!strcmp(word, "glitch") && sscanf(line, "%*s %31s %lu", label, &a) == 2) {
+            s.kind = stGlitch;
+            strcpy(s.label, label);
+        } else if (!strcmp(word, "remove") && sscanf(line, "%*s %31s %lu", label, &a) == 2) {
+            s.kind = stRemove;
+            strcpy(s.label, label);
+        } else if (!strcmp(word, "battery") && sscanf(line, "%*s %31s", label) == 1) {
+            s.kind = stBattery;
+            a = !strcmp(label, "low");
+        } else {
+            fprintf(stderr, "%s:%d: cannot parse\n", name, n);
+            exit(2);
+        }
+        s.arg = a;
+        steps = realloc(steps, (nSteps + 1) * sizeof(*steps));
+        steps[nSteps++] = s;
+    }
+    fclose(fp);
+}
+
+void RealPowerOff(void) {
+    if (open) ActionEnd(0);
+    longjmp(simExit, 2);
+}
+
+/* ---- Report and budget ---- */
+
+/* A budget line is "label ms sectors commands eewrites", the most
+   each action of that label may cost, or one of "underruns n",
+   "badpages n", "badfiles n", "corrupt n", "badcount n" (the file
+   count is not the card's) and "gap ms" for the run.
+   An action with a budget must also reach audio. */
+struct BUDGET {
+    char label[32];
+    u_int32 v[4];
+    u_int16 n;
+};
+static struct BUDGET *budgets;
+static u_int16 nBudgets;
+static FILE *report;
+static u_int16 over;
+
+static void LoadBudget(const char *name) {
+    FILE *fp = fopen(name, "r");
+    char line[256];
+    int n = 0;
+
+    if (!fp) {
+        perror(name);
+        exit(2);
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        struct BUDGET b;
+        unsigned long v[4];
+        int k;
+        char *hash = strchr(line, '#');
+        n++;
+        if (hash) *hash = 0;
+        memset(&b, 0, sizeof(b));
+        k = sscanf(line, "%31s %lu %lu %lu %lu", b.label, &v[0], &v[1], &v[2], &v[3]);
+        if (k <= 0) continue;
+        if (k != 2 && k != 5) {
+            fprintf(stderr, "%s:%d: cannot parse\n", name, n);
+            exit(2);
+        }
+        for (b.n = 0; b.n < k - 1; b.n++) b.v[b.n] = v[b.n];
+        budgets = realloc(budgets, (nBudgets + 1) * sizeof(*budgets));
+        budgets[nBudgets++] = b;
+    }
+    fclose(fp);
+}
+
+static struct BUDGET *Budget(const char *label, u_int16 n) {
+    u_int16 i;
+
+    for (i = 0; i < nBudgets; i++) {
+        if (budgets[i].n == n && !strcmp(budgets[i].label, label)) return &budgets[i];
+    }
+    return NULL;
+}
+
+/* One report row; over budget if limit is given and value above it. */
+static void Row(const char *item, const char *metric, u_int32 value, const u_int32 *limit) {
+    const char *status = "";
+
+    if (limit) {
+        status = value > *limit ? "over" : "ok";
+        if (value > *limit) {
+            over++;
+            fprintf(stderr, "hostsim: %s %s %u, budget %u\n", item, metric, value, *limit);
+        }
+    }
+    if (report) {
+        if (limit) fprintf(report, "%s,%s,%u,%u,%s\n", item, metric, value, *limit, status);
+        else fprintf(report, "%s,%s,%u,,\n", item, metric, value);
+    }
+}
+
+static void RunRow(const char *metric, u_int32 value) {
+    struct BUDGET *b = Budget(metric, 1);
+    Row("run", metric, value, b ? &b->v[0] : NULL);
+}
+
+static void Finish(void) {
+    u_int16 i;
+    u_int32 maxCycles = 0, page = 0;
+    double hours = sim.listenNs / 3.6e12;
+
+    if (report) fputs("item,metric,value,budget,status\n", report);
+    printf("%-12s %7s %7s %8s %6s %8s %9s %4s\n", "action", "ms", "sectors",
+           "commands", "fat", "eewrites", "mmcbytes", "tier");
+    for (i = 0; i < nActions; i++) {
+        struct ACTION *a = &actions[i];
+        struct BUDGET *b = Budget(a->label, 4);
+        static const u_int32 zero = 0;
+        printf("%-12s %7lu %7u %8u %6u %8u %9u %4u%s\n", a->label,
+               (unsigned long)(a->cost.ns / NS_PER_MS), a->cost.sectors,
+               a->cost.commands, a->cost.fatSectors, a->cost.eeWrites,
+               a->cost.mmcBytes, a->tier, a->timedOut ? " no audio" : "");
+        Row(a->label, "ms", (u_int32)(a->cost.ns / NS_PER_MS), b ? &b->v[0] : NULL);
+        Row(a->label, "sectors", a->cost.sectors, b ? &b->v[1] : NULL);
+        Row(a->label, "commands", a->cost.commands, b ? &b->v[2] : NULL);
+        Row(a->label, "ee_writes", a->cost.eeWrites, b ? &b->v[3] : NULL);
+        Row(a->label, "fat_sectors", a->cost.fatSectors, NULL);
+        Row(a->label, "mmc_bytes", a->cost.mmcBytes, NULL);
+        Row(a->label, "tier", a->tier, NULL);
+        Row(a->label, "no_audio", a->timedOut, b ? &zero : NULL);
+    }
+    for (i = 0; i < EE_SIZE / EE_PAGE; i++) {
+        if (ee.cycles[i] > maxCycles) {
+            maxCycles = ee.cycles[i];
+            page = i;
+        }
+        if (opt.wear && ee.cycles[i]) {
+            printf("eeprom page %4u (0x%04x): %u write cycles\n", i, i * EE_PAGE, ee.cycles[i]);
+        }
+    }
+    printf("simulated %.1f s, played %.1f s of %u files\n",
+           sim.now / 1e9, sim.listenNs / 1e9, sim.files);
+    printf("sectors %u, commands %u, FAT sectors %u, idle calls %u\n",
+           sim.c.sectors, sim.c.commands, sim.c.fatSectors, sim.idleCalls);
+    printf("underruns %u (%u during card faults), bad pages %u, bad files %u, corrupt bytes %u\n",
+           sim.underruns, sim.faultUnderruns, sim.badPages, sim.badFiles, sim.corrupt);
+    if (sim.cardFiles) {
+        printf("file count %u, %u chapters on the card\n", player.totalFiles, sim.cardFiles);
+    }
+    printf("gaps %u, average %.1f ms, longest %.1f ms\n", sim.gaps,
+           sim.gaps ? sim.gapSum / 1e6 / sim.gaps : 0.0, sim.gapMax / 1e6);
+    printf("clock sets %u, played at clockX:", sim.clockSets);
+    for (i = 2; i <= CLOCKX_MAX; i++) {
+        printf(" %u:%.0f%%", i, sim.listenNs ? 100.0 * sim.clockNs[i] / sim.listenNs : 0.0);
+    }
+    printf("\neeprom write cycles %u, most %u on page 0x%04x",
+           sim.c.eeWrites, maxCycles, page * EE_PAGE);
+    if (hours > 0 && maxCycles > 0) {
+        printf(" (%.1f per listening hour, %.0f hours to 1,000,000)",
+               maxCycles / hours, 1e6 * hours / maxCycles);
+    }
+    printf("\n");
+    RunRow("underruns", sim.underruns);
+    RunRow("fault_underruns", sim.faultUnderruns);
+    RunRow("badpages", sim.badPages);
+    RunRow("badfiles", sim.badFiles);
+    RunRow("corrupt", sim.corrupt);
+    RunRow("badcount", sim.cardFiles && player.totalFiles != sim.cardFiles);
+    RunRow("gap", (u_int32)(sim.gapMax / NS_PER_MS));
+    RunRow("ee_writes", sim.c.eeWrites);
+    RunRow("ee_page_cycles", maxCycles);
+    RunRow("ee_page_cycles_hour", hours > 0 ? (u_int32)(maxCycles / hours + 0.5) : 0);
+    RunRow("listen_ms", (u_int32)(sim.listenNs / NS_PER_MS));
+    if (over) printf("%u over budget\n", over);
+}
+
+/* ---- Sector read rates ---- */
+
+static void Throughput(u_int32 n) {
+    static u_int16 buf[256];
+    u_int64 t;
+    u_int32 i, commands;
+
+    Initialize();
+    InitializeMmc(50);
+    t = sim.now;
+    commands = sim.c.commands;
+    for (i = 0; i < n; i++) map->Read(map, 1000 + i, 1, buf);
+    map->Flush(map, 0);
+    printf("sequential: %u sectors in %.1f ms, %.0f sectors/s, %u commands\n",
+           n, (sim.now - t) / 1e6, n * 1e9 / (sim.now - t), sim.c.commands - commands);
+    t = sim.now;
+    commands = sim.c.commands;
+    for (i = 0; i < n; i++) map->Read(map, 1000 + Random() % (imgSectors - 1000), 1, buf);
+    map->Flush(map, 0);
+    printf("random: %u sectors in %.1f ms, %.0f sectors/s, %u commands\n",
+           n, (sim.now - t) / 1e6, n * 1e9 / (sim.now - t), sim.c.commands - commands);
+}
+
+int main(int argc, char **argv) {
+    const char *script = NULL, *cardIn = NULL, *cardOut = NULL, *eeName = NULL;
+    const char *reportName = NULL;
+    u_int32 throughput = 0;
+    int c;
+
+    while ((c = getopt(argc, argv, "s:c:o:e:n:t:b:xf:d:uji:l:wr:g:T:")) != -1) {
+        switch (c) {
+        case 's': script = optarg; break;
+        case 'c': cardIn = optarg; break;
+        case 'o': cardOut = optarg; break;
+        case 'e': eeName = optarg; break;
+        case 'n': opt.files = atoi(optarg); break;
+        case 't': opt.seconds = atoi(optarg); break;
+        case 'b': opt.bitrate = atoi(optarg); break;
+        case 'x': opt.seekIdx = 1; break;
+        case 'f': opt.fragEvery = atoi(optarg); break;
+        case 'd': opt.subdir = atoi(optarg); break;
+        case 'u': opt.unlink = 1; break;
+        case 'j': opt.falseCapture = 1; break;
+        case 'i': opt.serial = strtoul(optarg, NULL, 0); break;
+        case 'l': opt.accessNs = strtoul(optarg, NULL, 0) * 1000ULL; break;
+        case 'w': opt.wear = 1; break;
+        case 'r': reportName = optarg; break;
+        case 'g': LoadBudget(optarg); break;
+        case 'T': throughput = atoi(optarg); break;
+        default:
+            fputs("Usage: hostsim [-s script] [-c card.img] [-o card.img] [-e eeprom.bin]\n"
+                  "               [-n files] [-t seconds] [-b bitrate] [-x] [-f n] [-d n] [-u]\n"
+                  "               [-j] [-i serial] [-l us] [-w] [-r report.csv]\n"
+                  "               [-g budget] [-T sectors]\n", stderr);
+            return 2;
+        }
+    }
+    if (opt.files == 0 || opt.seconds == 0 || opt.bitrate < 8000 ||
+        opt.subdir > opt.files) {
+        fputs("hostsim: bad card parameters\n", stderr);
+        return 2;
+    }
+    if (cardIn) {
+        LoadFile(cardIn, &img, &imgSectors);
+        imgSectors /= 512;
+    } else {
+        MakeCard();
+        if (cardOut) SaveFile(cardOut, img, imgSectors * 512);
+    }
+    memset(ee.mem, 0xff, sizeof(ee.mem));
+    if (eeName && access(eeName, R_OK) == 0) {
+        unsigned char *p = ee.mem;
+        u_int32 n;
+        LoadFile(eeName, &p, &n);
+    }
+    card.answering = 1;
+    nextUi = UI_TRIGGER_MS * NS_PER_MS;
+    scriptWake = ~0ULL;     /* never, until the script starts */
+    alarm(600);
+
+    if (throughput) {
+        Throughput(throughput);
+        return 0;
+    }
+    if (script) {
+        LoadScript(script);
+    } else {
+        static struct STEP play = {stPlay, "", 0, 10000};
+        steps = &play;
+        nSteps = 1;
+    }
+    ActionStart("boot");
+    open->hit = 1;
+    scriptWake = sim.now;
+    if (!setjmp(simExit)) {
+        osab_main();
+    }
+    if (open) ActionEnd(1);
+    if (reportName && !(report = fopen(reportName, "w"))) {
+        perror(reportName);
+        return 2;
+    }
+    Finish();
+    if (report && fclose(report)) {
+        perror(reportName);
+        return 2;
+    }
+    if (eeName) SaveFile(eeName, ee.mem, sizeof(ee.mem));
+    return over ? 1 : 0;
+}
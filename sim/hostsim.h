@@ -0,0 +1,274 @@
+/*
+ * hostsim.h - VS1000 ROM and library interface for building osab.c
+ *             with gcc, for the host simulation in hostsim.c.
+ *
+ * Copyright (C) 2011-2020 Theophilus (http://theaudiobible.org)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy of this software and associated documentation files (the "Software"), to deal in the Software without restriction, including without limitation the rights to use, copy, modify, merge, publish, distribute, sublicense, and/or sell copies of the Software, and to permit persons to whom the Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
+ *
+ */
+
+/*
+ * Every VS1000 header osab.c includes (vs1000.h, minifat.h, player.h,
+ * ...) is a one-line file in this directory that includes this one.
+ * Only what osab.c uses is declared; names and meanings follow the
+ * vs1000b-lib headers, the values are the simulation's own.
+ *
+ * The VS1000 is word addressed: sizeof counts 16-bit words and so do
+ * memcpy(), memset() and memcmp().  When osab.c is compiled, the
+ * macros at the end make gcc count the same way; hostsim.c defines
+ * HOSTSIM_C and works in bytes.
+ */
+
+#ifndef HOSTSIM_H
+#define HOSTSIM_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#pragma pack(push, 2)
+
+typedef unsigned short u_int16;
+typedef short s_int16;
+typedef unsigned int u_int32;
+typedef int s_int32;
+
+/* Peripheral registers */
+enum hostRegister {
+    GPIO0_MODE = 1, GPIO0_DDR, GPIO0_ODATA, GPIO0_IDATA,
+    GPIO0_SET_MASK, GPIO0_CLEAR_MASK,
+    GPIO1_MODE, GPIO1_DDR, GPIO1_ODATA, GPIO1_IDATA,
+    SPI0_CONFIG, SPI0_CLKCONFIG, SPI0_FSYNC,
+    SCI_STATUS,
+    INT_ENABLEL, INT_ENABLEH,
+    TIMER_ENABLE, TIMER_T1L, TIMER_T1H, TIMER_T1CNTL, TIMER_T1CNTH,
+    HOST_REGISTERS
+};
+u_int16 *HostPerip(u_int16 reg);
+#define PERIP(reg) (*HostPerip(reg))
+
+#define SPI_CF_DLEN8            0x0007
+#define SPI_CF_DLEN16           0x000f
+#define SPI_CF_FSIDLE0          0x0000
+#define SPI_CF_FSIDLE1          0x0010  /* xCS high while idle */
+#define SPI_CF_MASTER           0x0020
+#define SPI_CC_CLKDIV           0x0001
+
+#define SCISTF_REGU_POWERLOW    0x0001
+#define SCISTF_REGU_POWERBUT    0x0002
+
+#define INTF_RX                 0x0001
+#define INTF_TIM0               0x0002
+#define INTF_TIM1               0x0004
+#define INTF_DAC                0x0001
+
+/* GPIO0: keys on bits 0..7, the card on 8..12 */
+#define KEY_1                   0x0001
+#define KEY_2                   0x0002
+#define KEY_3                   0x0004
+#define KEY_4                   0x0008
+#define KEY_5                   0x0010
+#define KEY_6                   0x0020
+#define KEY_7                   0x0040
+#define KEY_8                   0x0080  /* lock switch, high when unlocked */
+#define MMC_MISO                0x0100
+#define MMC_CLK                 0x0200
+#define MMC_MOSI                0x0400
+#define MMC_XCS                 0x0800
+#define GPIO0_CS1               0x1000
+
+/* Key codes of the key map, as in player.h.patch */
+#define KEY_POWER               256
+#define KEY_RELEASED            0x4000
+#define KEY_LONG_PRESS          0x8000
+#define KEY_LONG_ONESHOT        0x8000  /* in the event: once per press */
+
+enum keyEvent {
+    ke_null = 0,
+    ke_previous, ke_next, ke_rewind, ke_forward,
+    ke_volumeUp, ke_volumeDown, ke_volumeUp2, ke_volumeDown2,
+    ke_earSpeakerToggle, ke_pauseToggle, ke_powerOff,
+    ke_ff_faster, ke_ff_slower, ke_ff_off,
+    ke_OT_NT, ke_bookNext, ke_bookPrev, ke_bookmark,
+    ke_markPrev, ke_markNext, ke_repeat, ke_resetBookmarks, ke_back
+};
+
+struct KeyMapping {
+    u_int16 key;
+    u_int16 event;
+};
+extern const struct KeyMapping *currentKeyMap;
+extern u_int16 keyOld;
+extern s_int16 keyOldTime;
+extern u_int16 uiTrigger;
+void KeyScan9(void);
+
+/* Hookable ROM functions and their ROM versions */
+void KeyEventHandler(enum keyEvent event);
+void RealKeyEventHandler(enum keyEvent event);
+void IdleHook(void);
+void PowerOff(void);
+void RealPowerOff(void);
+struct CodecServices;
+void LoadCheck(struct CodecServices *cs, s_int16 n);
+void RealLoadCheck(struct CodecServices *cs, s_int16 n);
+void HostSetHook(const char *hook, void (*func)(void));
+#define SetHookFunction(hook, func) HostSetHook(#hook, (void (*)(void))(func))
+
+/* System */
+void BusyWait10(void);
+u_int32 ReadTimeCount(void);
+extern u_int16 clockX;
+extern u_int32 hwSampleRate;
+void SetRate(u_int32 hz);
+enum voltIndex {
+    voltCorePlayer, voltIoPlayer, voltAnaPlayer,
+    voltCoreUSB, voltIoUSB, voltAnaUSB, voltEnd
+};
+extern u_int16 voltages[voltEnd];
+void PowerSetVoltages(u_int16 *v);
+
+/* EEPROM on SPI0 */
+u_int16 SpiSendReceive(u_int16 data);
+void SpiDelay(u_int16 n);
+
+/* MMC/SD, bit-banged on GPIO0 */
+#define MMC_GO_IDLE_STATE       0
+#define MMC_SEND_OP_COND        1
+#define MMC_SEND_IF_COND        8
+#define MMC_SEND_CSD            9
+#define MMC_SEND_CID            10
+#define MMC_STOP_TRANSMISSION   12
+#define MMC_SET_BLOCKLEN        16
+#define MMC_READ_SINGLE_BLOCK   17
+#define MMC_READ_MULTIPLE_BLOCK 18
+#define MMC_READ_OCR            58
+s_int16 MmcCommand(s_int16 cmd, u_int32 arg);
+u_int16 SpiSendReceiveMmc(u_int16 dataTopAligned, s_int16 bits);
+void SpiSendClocks(void);
+
+/* Audio */
+#define DEFAULT_AUDIO_BUFFER_SAMPLES 4096
+extern s_int16 audioBuffer[DEFAULT_AUDIO_BUFFER_SAMPLES];
+void InitAudio(void);
+u_int16 AudioBufFill(void);
+
+/* Codec */
+enum codecError {
+    ceOk = 0, ceFormatNotFound, ceUnexpectedFileFormat, ceCancelled,
+    ceOtherError
+};
+struct CodecServices {
+    u_int16 version;
+    u_int16 cancel;
+    u_int16 goTo;           /* seconds to start from, 0xffff for none */
+    s_int16 fastForward;
+    s_int32 fileSize;
+    s_int32 fileLeft;
+    u_int32 playTimeSeconds;
+    u_int32 playTimeSamples;
+};
+extern struct CodecServices cs;
+
+/* Player */
+struct PLAYER {
+    s_int16 volume;
+    s_int16 volumeOffset;
+    u_int16 pauseOn;
+    s_int16 nextStep;
+    s_int16 currentFile;
+    s_int16 nextFile;
+    s_int16 totalFiles;
+    u_int16 ffCount;
+};
+extern struct PLAYER player;
+s_int16 PlayCurrentFile(void);
+void PlayerVolume(void);
+
+/* Mapper */
+struct FsPhysical;
+struct FsMapper {
+    u_int16 version;
+    u_int16 blockSize;
+    u_int32 blocks;
+    u_int16 cacheBlocks;
+    struct FsMapper *(*Create)(struct FsPhysical *physical, u_int16 cacheSize);
+    s_int16 (*Delete)(struct FsMapper *map);
+    u_int16 (*Read)(struct FsMapper *map, u_int32 firstBlock, u_int16 blocks, u_int16 *data);
+    u_int16 (*Write)(struct FsMapper *map, u_int32 firstBlock, u_int16 blocks, u_int16 *data);
+    s_int16 (*Free)(struct FsMapper *map, u_int32 firstBlock, u_int16 blocks);
+    s_int16 (*Flush)(struct FsMapper *map, u_int16 hard);
+    struct FsPhysical *physical;
+};
+s_int16 FsMapFlNullOk(struct FsMapper *map);
+
+/* Minifat */
+#define MAX_FRAGMENTS           4
+#define FAT_MKID(a, b, c)       (((u_int32)(a) << 16) | ((b) << 8) | (c))
+struct FRAGMENT {
+    u_int32 start;          /* LBA, bit 31 set on the last fragment */
+    u_int16 size;           /* sectors */
+};
+struct MINIFATINFO {
+    const u_int32 *supportedSuffixes;
+    u_int32 fileSize;
+    u_int32 currentSector;  /* LBA held in minifatBuffer */
+    u_int32 fragmentBase;   /* file sector of minifatFragments[0] */
+    u_int32 nextCluster;    /* first cluster not listed, 0 if none */
+    /* volume */
+    u_int32 fatStart;
+    u_int32 dataStart;
+    u_int32 rootCluster;    /* 0: FAT12/16 root directory at rootStart */
+    u_int32 rootStart;
+    u_int16 rootSectors;
+    u_int16 clusterSectors;
+    u_int16 fatBits;
+    /* directory position of the last file opened */
+    u_int16 lastFile;
+    u_int32 lastEntry;
+};
+extern struct MINIFATINFO minifatInfo;
+extern struct FRAGMENT minifatFragments[MAX_FRAGMENTS];
+extern u_int16 minifatBuffer[256];
+s_int16 InitFileSystem(void);
+s_int16 OpenFile(u_int16 n);
+s_int16 FatFastOpenFile(u_int16 n);
+u_int16 OpenFileBaseName(const char *name);
+
+/* USB */
+typedef enum { SCSI_READY_FOR_COMMAND, SCSI_DATA_TO_HOST } SCSIStageEnum;
+typedef enum { SCSI_OK, SCSI_REQUEST_ERROR } SCSIStatusEnum;
+void PatchMSCPacketFromPC(void);
+
+#pragma pack(pop)
+
+#ifndef HOSTSIM_C
+/* osab.c: word-addressed types, vcc keywords and a main() the
+   simulation can call. */
+#pragma pack(2)
+#define sizeof(x) (sizeof(x) / 2)
+#define memcpy(d, s, n) memcpy((d), (s), (size_t)(n) * 2)
+#define memset(d, c, n) memset((d), (c), (size_t)(n) * 2)
+#define memcmp(a, b, n) memcmp((a), (b), (size_t)(n) * 2)
+#define auto
+#define __i0
+#define __i1
+#define __a0
+#define __a1
+#define __c0
+#define __c1
+#define __reg_a
+#define __reg_b
+#define __y
+#define __x
+#define main osab_main
+/* vcc keeps const data in RAM, and osab.c writes mmcMapper.blocks */
+#define const
+#endif
+
+#endif /* HOSTSIM_H */
@@ -0,0 +1,2 @@
+/* minifat.h for the host simulation, see hostsim.h */
+#include "hostsim.h"
@@ -0,0 +1,2 @@
+/* player.h for the host simulation, see hostsim.h */
+#include "hostsim.h"
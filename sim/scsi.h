@@ -0,0 +1,2 @@
+/* scsi.h for the host simulation, see hostsim.h */
+#include "hostsim.h"
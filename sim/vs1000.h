@@ -0,0 +1,2 @@
+/* vs1000.h for the host simulation, see hostsim.h */
+#include "hostsim.h"
@@ -0,0 +1,2 @@
+/* vsNand.h for the host simulation, see hostsim.h */
+#include "hostsim.h"